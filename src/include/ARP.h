@@ -10,6 +10,14 @@
 #include "Ethernet.h"
 #include "IP.h"
 
+/**
+ * @brief The ARP neighbor subsystem.
+ * Each neighbor goes through INCOMPLETE (resolving, with packets queued),
+ * REACHABLE (recently confirmed), STALE (usable but unconfirmed) and PROBE
+ * (confirming by unicast requests while still in use). Neighbors in use are
+ * probed before going stale, and neighbors are also learned from requests
+ * to us and updated by gratuitous ARP.
+ */
 class ARP {
 public:
   using L2 = Ethernet;
@@ -26,6 +34,14 @@ public:
   static constexpr uint16_t OP_RESPONSE = 2;
 
   static constexpr Timer::Duration EXPIRE_CYCLE = 1200s;
+  // Time for a confirmed neighbor to be considered reachable.
+  static constexpr Timer::Duration REACHABLE_TIME = 30s;
+  // Interval of the first retransmitted request, doubled for each retry.
+  static constexpr Timer::Duration RETRANS_TIME = 1s;
+  // Maximum requests to resolve or probe a neighbor.
+  static constexpr int MAX_REQUESTS = 3;
+  // Maximum packets queued for a resolving neighbor.
+  static constexpr size_t QUEUE_LEN = 256;
 
   struct Packet {
     uint16_t hrd; // Hardware address space.
@@ -47,14 +63,47 @@ public:
   ARP(const ARP &) = delete;
 
   /**
-   * @brief Query for L2 address of a L3 target.
+   * @brief Query for L2 address of a L3 target, starting to resolve it
+   * through the device if unknown.
    *
    * @param target The L3 target of query.
+   * @param device The device to the target.
    * @param res The result.
    * @return 0 on success, negative on error.
    * Including: E_WAIT_FOR_TRYAGAIN
    */
-  int query(L3::Addr target, L2::Addr &res);
+  int query(L3::Addr target, L2::Device *device, L2::Addr &res);
+
+  /**
+   * @brief Queue an IP packet to a resolving neighbor, to be sent once
+   * resolved. The oldest one is dropped if the queue is full.
+   *
+   * @param target The L3 target (next hop) of the packet.
+   * @param packet The packet allocated by `malloc`, owned by ARP afterwards.
+   * @param packetLen Length of the packet.
+   * @param timeout Drop the packet if not sent in time.
+   */
+  void enqueue(L3::Addr target, void *packet, size_t packetLen,
+               Timer::Duration timeout);
+
+  /**
+   * @brief Announce an address by gratuitous ARP.
+   *
+   * @param addr The L3 address.
+   * @param device The device with the address.
+   * @return 0 on success, negative on error.
+   */
+  int announce(L3::Addr addr, L2::Device *device);
+
+  /**
+   * @brief Add a neighbor known from elsewhere (e.g. a snapshot) as stale, to
+   * be used at once and confirmed on use.
+   *
+   * @param addr The L3 address.
+   * @param linkAddr The L2 address.
+   * @param device The device to the neighbor.
+   */
+  void addStale(L3::Addr addr, L2::Addr linkAddr, L2::Device *device);
 
   /**
    * @brief Handle the result of waiting.
@@ -79,9 +128,22 @@ public:
    */
   int setup();
 
+  enum class State { INCOMPLETE, REACHABLE, STALE, PROBE };
+
+  struct QueuedPacket {
+    void *packet;
+    size_t packetLen;
+    Timer::TimePoint deadline;
+  };
+
   struct TabEntry {
-    L2::Addr linkAddr;
-    Timer::Task *expire;
+    L2::Addr linkAddr; // Unknown if INCOMPLETE.
+    L2::Device *device;
+    State state;
+    int nRequests;      // Requests sent in the current INCOMPLETE or PROBE.
+    bool used;          // Used since the last confirmation.
+    Timer::Task *timer; // For retransmission, or the next state.
+    Vector<QueuedPacket> queue;
   };
 
   const HashMap<L3::Addr, TabEntry> &getTable();
@@ -96,7 +158,13 @@ private:
 
   HashMultiMap<L3::Addr, WaitingEntry> waiting;
 
-  int sendRequest(L3::Addr target);
+  int sendRequest(L3::Addr target, const TabEntry &entry);
+  void startTimer(L3::Addr target, TabEntry &entry, Timer::Duration timeout);
+  void handleTimer(L3::Addr target);
+  void removeEntry(HashMap<L3::Addr, TabEntry>::iterator it);
+  void notifyWaiting(L3::Addr target, bool succ);
+  void learn(L3::Addr addr, L2::Addr linkAddr, L2::Device *device,
+             bool confirmed, bool create);
 
   void handleRecv(const void *buf, size_t len, const L2::RecvInfo &info);
 };
@@ -0,0 +1,107 @@
+#ifndef NETSTACK_CONGESTION_CONTROL_H
+#define NETSTACK_CONGESTION_CONTROL_H
+
+#include "TCP.h"
+
+/**
+ * @brief NewReno congestion control (RFC 5681, RFC 6582): slow start up to
+ * `ssthresh`, then one MSS per RTT, halving the window on loss.
+ */
+class NewReno : public TCP::CongestionControl {
+public:
+  const char *name() const override;
+  void init(uint32_t mss) override;
+  void onAck(const AckInfo &info) override;
+  void onLoss(const LossInfo &info) override;
+
+private:
+  uint32_t ackedBytes; // Acknowledged since the last growth in avoidance.
+};
+
+/**
+ * @brief CUBIC congestion control (RFC 9438). The window grows by a cubic
+ * function of the time since the last loss, centered on the window at the
+ * loss, so it recovers quickly on paths with a large bandwidth-delay product.
+ */
+class Cubic : public TCP::CongestionControl {
+public:
+  static constexpr double C = 0.4;
+  static constexpr double BETA = 0.7; // Multiplicative decrease factor.
+
+  const char *name() const override;
+  void init(uint32_t mss) override;
+  void onAck(const AckInfo &info) override;
+  void onLoss(const LossInfo &info) override;
+
+private:
+  double wMax;    // Window before the last reduction, in MSS.
+  double wEst;    // The window NewReno would have, in MSS.
+  double k;       // Time for the cubic function to reach `wMax`, in seconds.
+  double cwndInc; // Increase accumulated below one MSS, in bytes.
+  Timer::TimePoint epochStart; // Start of the current avoidance epoch.
+  bool inEpoch;
+};
+
+/**
+ * @brief BBR congestion control: a model of the path by the bottleneck
+ * bandwidth (the max delivery rate of recent rounds) and the min RTT. The
+ * sender paces at about the bandwidth and keeps about two bandwidth-delay
+ * products in flight, cycling the pacing gain to probe for more bandwidth,
+ * so it neither fills the queues nor backs off on random losses.
+ */
+class Bbr : public TCP::CongestionControl {
+public:
+  static constexpr double HIGH_GAIN = 2.885; // 2 / ln(2), doubles per round
+  static constexpr double CWND_GAIN = 2;
+  static constexpr int BW_ROUNDS = 10; // Window of the bandwidth filter
+  static constexpr int CYCLE_LEN = 8;  // Pacing gain cycle in PROBE_BW
+  static constexpr Timer::Duration MIN_RTT_WINDOW = 10s;
+  static constexpr Timer::Duration PROBE_RTT_TIME = 200ms;
+  static constexpr uint32_t MIN_CWND_SEGS = 4;
+
+  const char *name() const override;
+  void init(uint32_t mss) override;
+  void onAck(const AckInfo &info) override;
+  void onLoss(const LossInfo &info) override;
+
+private:
+  enum class Mode {
+    STARTUP,   // Probe the bandwidth exponentially.
+    DRAIN,     // Drain the queue built in the startup.
+    PROBE_BW,  // Cycle the pacing gain around the bandwidth.
+    PROBE_RTT, // Shrink the window to measure the min RTT.
+  } mode;
+
+  // Update the bandwidth and the min RTT filters by the sample.
+  void updateModel(const AckInfo &info);
+
+  // Advance `mode` and set the gains.
+  void updateMode(const AckInfo &info);
+
+  void enterProbeBw(Timer::TimePoint now);
+
+  // The bandwidth-delay product scaled by `gain`, in bytes.
+  uint32_t bdp(double gain, uint32_t mss) const;
+
+  double btlBw;               // Bottleneck bandwidth, in bytes per second.
+  double bwRounds[BW_ROUNDS]; // Max delivery rate of recent rounds.
+  Timer::Duration minRtt;     // 0 if not sampled yet.
+  Timer::TimePoint minRttStamp;
+  bool isMinRttExpired;
+
+  uint64_t round;             // Round trips counted by delivered data.
+  uint64_t nextRoundDelivered;
+  bool isRoundStart;
+
+  double fullBw; // Bandwidth reached in the startup, to detect a full pipe.
+  int fullBwRounds;
+  bool isFullPipe;
+
+  double pacingGain, cwndGain;
+  int cycleIndex;
+  Timer::TimePoint cycleStamp;
+  Timer::TimePoint probeRttDone; // Zero until the window has shrunk.
+  uint32_t priorCwnd;            // To be restored after PROBE_RTT.
+};
+
+#endif
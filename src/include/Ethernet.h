@@ -36,6 +36,9 @@ public:
 
   static constexpr Addr BROADCAST{0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
+  // The MTU assumed if not available from the kernel.
+  static constexpr size_t DEFAULT_MTU = 1500;
+
   struct Header {
     Addr dst;
     Addr src;
@@ -48,11 +51,13 @@ public:
   Ethernet(const Ethernet &) = delete;
 
   class Device : public NetBase::Device {
-    Device(struct pcap *p_, const char *name_, const Addr &addr_);
+    Device(struct pcap *p_, const char *name_, const Addr &addr_,
+           size_t mtu_);
     friend class Ethernet;
 
   public:
-    const Addr addr; // Ethernet (MAC) address of the device.
+    const Addr addr;  // Ethernet (MAC) address of the device.
+    const size_t mtu; // Max payload length of a frame.
   };
 
   /**
@@ -72,7 +77,8 @@ public:
   Device *findDeviceByName(const char *name);
 
   /**
-   * @brief Send a frame through the device.
+   * @brief Send a frame through the device, with the payload no longer than
+   * its MTU.
    *
    * @param data Pointer to the payload.
    * @param dataLen Length of the payload.
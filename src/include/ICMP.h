@@ -32,6 +32,22 @@ public:
    */
   int sendTimeExceeded(const void *orig, int origLen, const IP::RecvInfo &info);
 
+  /**
+   * @brief Send Destination Unreachable Message back for an IP packet.
+   *
+   * @param orig Pointer to the original packet.
+   * @param origLen Length of the original packet.
+   * @param code The reason, e.g. 4 for fragmentation needed and DF set.
+   * @param nextHopMtu The MTU of the next hop, with code 4 (RFC 1191).
+   * @param device The device the packet was received from.
+   * @param srcMAC The link layer source of the packet.
+   *
+   * @return 0 on success, negative on error.
+   */
+  int sendDestUnreachable(const void *orig, int origLen, int code,
+                          uint16_t nextHopMtu, IP::L2::Device *device,
+                          IP::L2::Addr srcMAC);
+
   /**
    * @brief Send Echo or Reply Message.
    *
@@ -65,6 +81,19 @@ public:
     virtual int handle(const void *data, int dataLen, const Info &info) = 0;
   };
 
+  /**
+   * @brief Get the MTU reported by a fragmentation needed message, guessed
+   * if not reported. It is not trusted as the path MTU until the quoted
+   * packet is validated by its transport (RFC 5927).
+   *
+   * @param header The ICMP header.
+   * @param data The quoted original packet.
+   * @param dataLen Length of the quoted packet.
+   * @return The MTU, 0 if the quote is truncated.
+   */
+  static size_t getFragNeededMtu(const Header &header, const void *data,
+                                 int dataLen);
+
   void addRecvCallback(RecvCallback *callback);
   int removeRecvCallback(RecvCallback *callback);
 
@@ -73,6 +102,11 @@ public:
 private:
   Vector<RecvCallback *> callbacks;
 
+  // Send an error message back to the source of the original packet, quoting
+  // its header and first 8 data bytes.
+  int sendError(const Header &header, const void *orig, int origLen,
+                IP::L2::Device *device, IP::L2::Addr srcMAC);
+
   void handleRecv(const void *msg, size_t msgLen, const IP::RecvInfo &info);
 };
 
@@ -52,6 +52,16 @@ public:
 
   static constexpr Addr BROADCAST{255, 255, 255, 255};
 
+  // Limits on the datagrams being reassembled.
+  static constexpr Timer::Duration REASSEMBLY_TIMEOUT = 30s;
+  static constexpr size_t REASSEMBLY_MEM = 4 << 20; // Buffered bytes in all.
+  static constexpr size_t MAX_FRAGMENTS = 64;       // Fragments of a datagram.
+
+  // Path MTU discovery (RFC 1191).
+  static constexpr size_t MIN_MTU = 68;
+  static constexpr Timer::Duration PATH_MTU_TIMEOUT = 10min;
+  static constexpr size_t MAX_PATH_MTUS = 4096; // Destinations remembered.
+
   struct Header {
     uint8_t versionAndIHL; // version:4 | IHL:4
     uint8_t typeOfService;
@@ -80,7 +90,8 @@ public:
   };
 
   /**
-   * @brief Assign an IP address to a device.
+   * @brief Assign an IP address to a device, and announce it by gratuitous
+   * ARP.
    *
    * @param entry The address entry to be added.
    */
@@ -93,6 +104,13 @@ public:
    */
   const Vector<DevAddr> &getAddrs();
 
+  /**
+   * @brief Get the assigned IP addresses grouped by device.
+   *
+   * @return The devices (with any address) and their addresses.
+   */
+  const HashMap<L2::Device *, Vector<DevAddr>> &getDeviceAddrs();
+
   /**
    * @brief Get any IP address of a device. If there is no such address, get any
    * of the host.
@@ -114,6 +132,35 @@ public:
    */
   int getSrcAddr(Addr dst, Addr &res);
 
+  /**
+   * @brief Get the MTU towards a destination, i.e. of the device routed to, or
+   * the path MTU learned if lower.
+   *
+   * @param dst The destination.
+   * @return The MTU, `L2::DEFAULT_MTU` if not routable.
+   */
+  size_t getMtu(Addr dst);
+
+  /**
+   * @brief Get the MTU of the device routed to a destination, regardless of
+   * the path MTU learned.
+   *
+   * @param dst The destination.
+   * @return The MTU, `L2::DEFAULT_MTU` if not routable.
+   */
+  size_t getDeviceMtu(Addr dst);
+
+  /**
+   * @brief Lower the path MTU to a destination, as reported by an ICMP
+   * fragmentation needed message validated by the transport. It is
+   * forgotten after `PATH_MTU_TIMEOUT`.
+   *
+   * @param dst The destination.
+   * @param mtu The reported MTU.
+   * @return 0 if lowered, 1 if ignored.
+   */
+  int lowerPathMtu(Addr dst, size_t mtu);
+
   /**
    * @brief Find the device by its assigned IP address.
    *
@@ -122,6 +169,14 @@ public:
    */
   L2::Device *findDeviceByAddr(Addr addr);
 
+  /**
+   * @brief Find the device by its directed broadcast address.
+   *
+   * @param addr The directed broadcast address of an assigned subnet.
+   * @return The link layer device found, `nullptr` if not found.
+   */
+  L2::Device *findDeviceByBroadcast(Addr addr);
+
   /**
    * @brief Implementation of the IP routing policy.
    */
@@ -146,8 +201,54 @@ public:
      * @return 0 on success, negative on error.
      */
     virtual int query(const Addr &dst, HopInfo &res) = 0;
+
+    /**
+     * @brief Query for the next hop of a flow. With multiple (equal-cost)
+     * next hops, the flow hash picks one, so packets of a flow keep in order.
+     *
+     * @param dst The destination IP address.
+     * @param flowHash The hash of the flow (see `IP::flowHash`).
+     * @param res To be filled with the gateway and device for the next hop.
+     * @return 0 on success, negative on error.
+     */
+    virtual int query(const Addr &dst, uint32_t flowHash, HopInfo &res) {
+      return query(dst, res);
+    }
+
+    /**
+     * @brief Query for the next hops to many destinations in one call.
+     *
+     * @param dsts The destination IP addresses.
+     * @param res To be filled with the next hops, with `nullptr` devices for
+     * the destinations without a route.
+     * @param n Number of the destinations.
+     * @param flowHashes The flow hashes of the destinations, all 0 if
+     * `nullptr`.
+     * @return Number of the destinations with a route.
+     */
+    virtual size_t queryBatch(const Addr *dsts, HopInfo *res, size_t n,
+                              const uint32_t *flowHashes = nullptr) {
+      size_t nFound = 0;
+      for (size_t i = 0; i < n; i++) {
+        if (query(dsts[i], flowHashes ? flowHashes[i] : 0, res[i]) == 0)
+          nFound++;
+        else
+          res[i].device = nullptr;
+      }
+      return nFound;
+    }
   };
 
+  /**
+   * @brief Hash the 5-tuple of a packet (or the addresses and protocol only,
+   * for non-first fragments and other protocols).
+   *
+   * @param packet The packet with the IP header.
+   * @param packetLen Length of the packet.
+   * @return The flow hash.
+   */
+  static uint32_t flowHash(const void *packet, size_t packetLen);
+
   /**
    * @brief Set the routing policy.
    *
@@ -167,13 +268,17 @@ public:
     L2::Addr dstMAC;
     uint8_t timeToLive = 64;
     bool autoRetry; // Automatically retry if need to wait.
-    Timer::Duration retryTimeout = 1s;
+    Timer::Duration retryTimeout = 1s; // Drop it if still waiting then.
     bool freeBuf; // Free the buffer after sending.
+    // The next hop if already resolved (when `dstMAC` is not given).
+    const Routing::HopInfo *hop = nullptr;
+    bool dontFragment = false; // Set DF instead of fragmenting.
   };
 
   /**
    * @brief Send a complete IP packet (leaving the checksum for
-   * recalculation).
+   * recalculation), fragmenting it if larger than the device MTU without DF
+   * set.
    *
    * @param buf Pointer to the packet (with checksum may be modified).
    * @param len Length of the packet.
@@ -186,7 +291,8 @@ public:
   int sendWithHeader(void *packet, size_t packetLen, SendOptions options);
 
   /**
-   * @brief Send an IP packet.
+   * @brief Send an IP packet, fragmenting it if larger than the device MTU
+   * and `dontFragment` is not set.
    *
    * @param data Pointer to the payload.
    * @param dataLen Length of the payload.
@@ -257,9 +363,83 @@ public:
 
 private:
   Vector<DevAddr> addrs;
+  HashMap<L2::Device *, Vector<DevAddr>> deviceAddrs;
+
+  // The devices an address is assigned to, or is the directed broadcast of a
+  // subnet of, for classifying a destination in one probe.
+  struct LocalAddr {
+    L2::Device *device;
+    L2::Device *broadcastDevice;
+  };
+  HashMap<Addr, LocalAddr> localAddrs;
   Routing *routing;
   List<RecvHandler> onRecvPromiscuous;
   HashMultiMap<uint8_t, RecvHandler> onRecv;
+  uint16_t nextId; // The `identification` of the next sent packet.
+
+  // Identifies the fragments of a datagram.
+  struct FragKey {
+    Addr src;
+    Addr dst;
+    uint16_t identification;
+    uint8_t protocol;
+    uint8_t zero;
+
+    friend bool operator==(const FragKey &a, const FragKey &b) {
+      return memcmp(&a, &b, sizeof(FragKey)) == 0;
+    }
+  } __attribute__((packed));
+
+  // A datagram being reassembled. Each fragment is copied once, straight to
+  // its place in `data`, which is then delivered as is.
+  struct Reassembly {
+    char header[60];  // Header of the first fragment.
+    size_t hdrLen;    // 0 if the first fragment not received.
+    char *data;       // The payload.
+    size_t dataCap;   // Allocated length of `data`.
+    size_t dataLen;   // Length of the payload, 0 if the last not received.
+    Vector<std::pair<size_t, size_t>> ranges; // Received, sorted & merged.
+    size_t nFragments;
+    Timer::Task *timer;
+    List<FragKey>::iterator age; // Position in `reassemblyAges`.
+  };
+  // Path MTUs learned (lower than of the devices).
+  struct PathMtu {
+    size_t mtu;
+    Timer::TimePoint expireTime;
+  };
+  HashMap<Addr, PathMtu> pathMtus;
+
+  HashMap<FragKey, Reassembly> reassemblies;
+  List<FragKey> reassemblyAges; // Oldest first, to be evicted.
+  size_t reassemblyMem;         // Sum of `dataCap`s.
+
+  /**
+   * @brief Send a packet to the link layer, in fragments if necessary.
+   *
+   * @param packet The packet with checksum calculated.
+   * @param packetLen Length of the packet.
+   * @param dstMAC The destination link layer address.
+   * @param device The device to send through.
+   * @return 0 on success, negative on error.
+   */
+  int sendFrames(const void *packet, size_t packetLen, L2::Addr dstMAC,
+                 L2::Device *device);
+
+  /**
+   * @brief Add a received fragment to be reassembled, and deliver the
+   * datagram when complete.
+   *
+   * @param data The payload of the fragment.
+   * @param dataLen Length of the payload.
+   * @param info The receiving information of the fragment.
+   */
+  void handleFragment(const void *data, size_t dataLen, const RecvInfo &info);
+
+  void removeReassembly(HashMap<FragKey, Reassembly>::iterator it);
+
+  // Deliver a local datagram to the handlers of its protocol.
+  void deliver(const void *data, size_t dataLen, const RecvInfo &info);
 
   void handleRecv(const void *packet, size_t packetCapLen,
                   const L2::RecvInfo &info);
@@ -20,10 +20,23 @@ public:
    */
   int setup();
 
+  // Maximum packets to be routed in one batch.
+  static constexpr size_t MAX_BURST = 64;
+
 private:
   bool isUp;
 
+  // Packets received in the current burst, waiting to be routed together.
+  struct Pending {
+    void *packet;
+    size_t packetLen;
+    IP::L2::Device *device; // Received from, for ICMP errors
+    IP::L2::Addr srcMAC;
+  };
+  Vector<Pending> burst;
+
   void handleRecv(const void *data, size_t dataLen, const IP::RecvInfo &info);
+  void flush();
 };
 
 #endif
@@ -5,10 +5,28 @@
 
 /**
  * @brief The Longest Prefix Match (LPM) routing table.
+ * Lookups walk a binary trie stored in a flat node array, which can be
+ * serialized to (and memory-mapped from) a compiled image file.
+ * A prefix may have multiple (equal-cost) next hops, chosen by flow hash.
  */
 class LpmRouting : public IP::Routing {
 public:
+  LpmRouting();
+  LpmRouting(const LpmRouting &) = delete;
+  ~LpmRouting();
+
+  // Maximum next hops of a prefix.
+  static constexpr int MAX_PATHS = 8;
+
   int query(const Addr &addr, HopInfo &res) override;
+  int query(const Addr &addr, uint32_t flowHash, HopInfo &res) override;
+
+  /**
+   * @brief Query many destinations with their trie walks interleaved, so the
+   * memory loads of different walks overlap.
+   */
+  size_t queryBatch(const Addr *dsts, HopInfo *res, size_t n,
+                    const uint32_t *flowHashes = nullptr) override;
 
   struct Entry {
     Addr addr;          // The address to be matched.
@@ -18,19 +36,113 @@ public:
   };
 
   /**
-   * @brief Set an routing entry
+   * @brief Set an routing entry, replacing all next hops of the prefix.
    *
    * @param entry The entry to be set.
    * @return 0 on success, negative on error.
    */
   int setEntry(const Entry &entry);
 
+  /**
+   * @brief Add a next hop to the prefix of the entry (set it if new).
+   *
+   * @param entry The entry with the next hop to be added.
+   * @return 0 on success (or if already there), 1 on invalid entry or
+   * `MAX_PATHS` reached.
+   */
+  int addPath(const Entry &entry);
+
+  /**
+   * @brief Delete a prefix with all its next hops.
+   *
+   * @return 0 on success, 1 if not found.
+   */
   int delEntry(Addr addr, Addr mask);
 
+  /**
+   * @brief Get the routing entries, one per next hop.
+   */
   const Vector<Entry> &getTable();
 
+  /**
+   * @brief Replace the whole table by a list of entries in one pass.
+   * Later entries override earlier ones with the same prefix.
+   *
+   * @param entries The entries to be set.
+   * @return 0 on success, 1 on invalid entry (the table is left empty).
+   */
+  int build(const Vector<Entry> &entries);
+
+  /**
+   * @brief Replace the whole table by routes in a text file, one
+   * `<ip> <mask> <device> <gateway>` per line ('#' for comments).
+   *
+   * @param path Path to the route file.
+   * @param l2 The link layer to look up devices by name.
+   * @return 0 on success, negative on error.
+   */
+  int loadFile(const char *path, L2 &l2);
+
+  /**
+   * @brief Save the compiled table (with its lookup trie) as an image.
+   *
+   * @param path Path to the image file.
+   * @return 0 on success, negative on error.
+   */
+  int saveImage(const char *path);
+
+  /**
+   * @brief Replace the whole table by a compiled image.
+   * The lookup trie is used from the memory-mapped file directly, until the
+   * table is modified.
+   *
+   * @param path Path to the image file.
+   * @param l2 The link layer to look up devices by name.
+   * @return 0 on success, negative on error.
+   */
+  int loadImage(const char *path, L2 &l2);
+
 private:
+  struct Key {
+    Addr addr;
+    Addr mask;
+    friend bool operator==(const Key &a, const Key &b) {
+      return a.addr == b.addr && a.mask == b.mask;
+    }
+  };
+
+  struct Node {
+    uint32_t child[2]; // 0 for none (the root is never a child).
+    int32_t entry;     // Index in `table` of the first next hop, -1 for none.
+  };
+
   Vector<Entry> table;
+  // Index in `table` of the next hop after each entry in the same prefix, -1
+  // for none.
+  Vector<int32_t> nextPath;
+  HashMap<Key, uint32_t> index; // prefix -> trie node
+  bool indexValid;
+
+  Vector<Node> nodes;
+  const Node *trie; // `nodes.data()`, or the nodes in the mapped image.
+  Vector<uint32_t> freeNodes; // Pruned from the trie, to be reused.
+
+  void *image; // The mapped image, `nullptr` if none.
+  size_t imageLen;
+
+  static int checkEntry(const Entry &entry);
+
+  void clear();
+  void unmapImage();
+  void makeWritable();
+
+  int findNode(Addr addr, Addr mask);
+  int insertNode(Addr addr, Addr mask);
+  void pruneNode(Addr addr, Addr mask);
+  int32_t pickPath(int32_t first, uint32_t flowHash);
+  int putEntry(const Entry &entry, bool addPath);
+  int32_t *findLink(size_t i);
+  void removeAt(size_t i);
 };
 
 #endif
@@ -86,6 +86,19 @@ public:
    */
   void addOnRecv(RecvHandler handler, int linkType);
 
+  /**
+   * @brief Handle the end of a burst of receiving frames, i.e. after all the
+   * frames available on the devices are handled.
+   */
+  using BurstEndHandler = std::function<void()>;
+
+  /**
+   * @brief Add a handler for the end of receiving bursts.
+   *
+   * @param handler The handler.
+   */
+  void addOnBurstEnd(BurstEndHandler handler);
+
   /**
    * @brief Handle a receiving frame.
    *
@@ -117,6 +130,7 @@ public:
 private:
   Vector<Device *> devices;
   HashMultiMap<int, RecvHandler> onRecv;
+  Vector<BurstEndHandler> onBurstEnd;
 
   std::atomic<bool> breaking;
 };
@@ -1,6 +1,8 @@
 #ifndef NETSTACK_NETSTACK_FULL_H
 #define NETSTACK_NETSTACK_FULL_H
 
+#include <string>
+
 #include "UDP.h"
 #include "RIP.h"
 #include "IPForward.h"
@@ -17,6 +19,7 @@ public:
   RIP *rip;
 
   NetStackFull();
+  ~NetStackFull();
 
   /**
    * @brief Need to be called before start looping, or in the thread of looping.
@@ -36,6 +39,38 @@ public:
    */
   int configRIP(Timer::Duration updateCycle = 30s, Timer::Duration expireCycle = 180s,
                 Timer::Duration cleanCycle = 120s);
+
+  /**
+   * @brief Save the ARP table and routes (RIP, or else static) to a
+   * warm-start snapshot.
+   * Need to be called when not looping, or in the thread of looping.
+   *
+   * @param path Path to the snapshot file.
+   * @return 0 on success, negative on error.
+   */
+  int saveSnapshot(const char *path);
+
+  /**
+   * @brief Load a warm-start snapshot. ARP entries come back stale (used at
+   * once, confirmed on use), and RIP routes as just refreshed.
+   * Need to be called after configuring devices, addresses and routing,
+   * before start looping or in the thread of looping.
+   *
+   * @param path Path to the snapshot file.
+   * @return 0 on success, negative on error.
+   */
+  int loadSnapshot(const char *path);
+
+  /**
+   * @brief Load a warm-start snapshot if any, and save it on destruction.
+   * Need to be called as `loadSnapshot`.
+   *
+   * @param path Path to the snapshot file.
+   */
+  void enableSnapshot(const char *path);
+
+private:
+  std::string snapshotPath; // Empty if disabled.
 };
 
 #endif
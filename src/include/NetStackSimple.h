@@ -49,6 +49,11 @@ public:
    */
   void wait();
 
+  /**
+   * @brief Check if the netstack loop is running.
+   */
+  bool isRunning();
+
   using Task = TaskDispatcher::Task;
 
   void invoke(Task task);
@@ -1,6 +1,7 @@
 #ifndef NETSTACK_RIP_H
 #define NETSTACK_RIP_H
 
+#include <random>
 #include <unordered_map>
 
 #include "NetBase.h"
@@ -22,6 +23,10 @@ public:
 
   static const int METRIC_INF;
 
+  // Maximum entries in one update datagram, of the max IP datagram length.
+  // Updates are split further by the MTU of each device.
+  static const int MAX_ENTRIES;
+
   UDP &udp;
   NetworkLayer &network;
   NetBase &netBase;
@@ -46,11 +51,24 @@ public:
     uint32_t metric;
   };
 
+  // An equal-cost alternative to the next hop of a route.
+  struct Path {
+    LinkLayer::Device *device;
+    Addr gateway;
+    Timer::TimePoint refreshTime;
+  };
+
   struct TabEntry {
     LinkLayer::Device *device;
     Addr gateway;
     int metric;
-    Timer::Task *expire;
+    // The last refresh (or going down) of a learned route, the epoch for
+    // permanent (local or static) routes.
+    Timer::TimePoint refreshTime;
+    bool changed; // Changed since the last (triggered) update.
+    // Until when updates from other gateways are ignored after going down.
+    Timer::TimePoint holdDown;
+    Vector<Path> altPaths; // Other gateways with the same metric (ECMP).
   };
 
   int setup();
@@ -58,10 +76,33 @@ public:
   int setEntry(const Addr &addr, const Addr &mask, const TabEntry &entry);
 
   int query(const Addr &addr, HopInfo &res) override;
+  int query(const Addr &addr, uint32_t flowHash, HopInfo &res) override;
+  size_t queryBatch(const Addr *dsts, HopInfo *res, size_t n,
+                    const uint32_t *flowHashes = nullptr) override;
 
   int sendRequest();
+
+  /**
+   * @brief Send the whole table, split into datagrams to fit the MTU of each
+   * device.
+   *
+   * @return 0 on success, negative on error.
+   */
   int sendUpdate();
 
+  /**
+   * @brief Send only the entries changed since the last update.
+   *
+   * @return 0 on success, negative on error.
+   */
+  int sendTriggeredUpdate();
+
+  /**
+   * @brief Schedule a triggered update. Updates are rate-limited by a
+   * jittered interval, and changes in between are sent together.
+   */
+  void triggerUpdate();
+
   struct Key {
     NetworkLayer::Addr addr;
     NetworkLayer::Addr mask;
@@ -74,22 +115,56 @@ public:
 
   const Table &getTable();
 
+  /**
+   * @brief Get the time when an entry expires (or is cleaned if unreachable).
+   *
+   * @param entry The table entry.
+   * @return The expiring time, `Timer::TimePoint::max()` if permanent.
+   */
+  Timer::TimePoint getExpireTime(const TabEntry &entry);
+  Timer::TimePoint getExpireTime(const Path &path);
+
   void setCycles(Timer::Duration updateCycle, Timer::Duration expireCycle,
                  Timer::Duration cleanCycle);
 
+  /**
+   * @brief Get the convergence time of the last route failure, i.e. from a
+   * route going down to the last change of the forwarding table after it.
+   *
+   * @return The convergence time, 0 if no route failure ever.
+   */
+  Timer::Duration getConvergenceTime();
+
 private:
-  Timer::Duration updateCycle, expireCycle, cleanCycle;
+  Timer::Duration updateCycle, expireCycle, cleanCycle, holdDownCycle;
 
   Table table;
   LpmRouting matchTable;
 
   void handleRecv(const void *msg, size_t msgLen, const UDP::RecvInfo &info);
 
+  void updateLocal();
+  int sendEntries(bool changedOnly);
+
   Timer::Task *updateTask;
+  Timer::Task *triggerTask;
+  Timer::Task *sweepTask;
+  Timer::TimePoint nextTrigger; // Earliest time for the next triggered update.
+  std::mt19937 rnd;
+
+  // Convergence tracking: the beginning of the last route failure episode,
+  // and the last change of the forwarding table.
+  Timer::TimePoint downTime, fibChangeTime;
+
+  void installPaths(const Key &key, const TabEntry &entry);
+  bool updateAltPath(const Key &key, TabEntry &entry, Addr gateway,
+                     LinkLayer::Device *device, int metric);
+  void promoteAltPath(const Key &key, TabEntry &entry);
+  void fibChanged();
+  void routeDown(TabEntry &entry);
 
-  void handleExpireTimer(Table::iterator entry);
-  void handleCleanTimer(Table::iterator entry);
   void handleUpdateTimer();
+  void handleSweepTimer();
 };
 
 #endif
@@ -4,6 +4,7 @@
 #include <random>
 
 #include "IP.h"
+#include "ICMP.h"
 
 class TCP {
 public:
@@ -36,6 +37,9 @@ public:
     OPT_END = 0,
     OPT_NOP = 1,
     OPT_MSS = 2,
+    OPT_WSCALE = 3,
+    OPT_SACK_PERMITTED = 4,
+    OPT_SACK = 5,
   };
 
   struct PseudoL3Header {
@@ -55,6 +59,9 @@ public:
   Timer &timer;
   L3 &l3;
   std::mt19937 rnd;
+  uint32_t rcvBufSize; // Receive buffer size of new connections.
+  uint32_t sndBufSize; // Send buffer size of new connections.
+  bool sackPermitted;  // Whether new connections offer SACK (RFC 2018).
 
   TCP(L3 &l3_);
   ~TCP();
@@ -118,14 +125,97 @@ public:
     Queue<WaitHandler> pdAccept;
   };
 
-  static constexpr uint32_t MSS = 1024;
-  static constexpr uint32_t BUF_SIZE = 128 << 10;
-  static constexpr Timer::Duration RETRANS_TIMEOUT = 500ms;
+  // The MSS assumed if the peer sends no MSS option (RFC 1122).
+  static constexpr uint32_t DEFAULT_MSS = 536;
+  static constexpr uint32_t BUF_SIZE = 1 << 20; // Default buffer sizes.
+  static constexpr uint8_t MAX_WND_SHIFT = 14;   // Window scaling (RFC 7323)
+  static constexpr int MAX_SACK_BLOCKS = 4;       // In the 40 option bytes
+  // Duplicate ACKs (or segments SACKed beyond a hole) that mean a loss.
+  static constexpr uint32_t DUP_THRESH = 3;
+  // Retransmission timeout bounds (RFC 6298).
+  static constexpr Timer::Duration INITIAL_RTO = 1s;
+  // Not below the delayed ACKs of peers (up to 200ms, RFC 1122), for a
+  // single segment in flight not to time out falsely. Linux's minimum too.
+  static constexpr Timer::Duration MIN_RTO = 200ms;
+  static constexpr Timer::Duration MAX_RTO = 60s;
+  static constexpr Timer::Duration CLOCK_GRANULARITY = 1ms;
   static constexpr Timer::Duration MSL = 60s;
+  // Delay of an ACK for less than two full segments (RFC 1122), well below
+  // `MIN_RTO` not to cause a retransmission by itself.
+  static constexpr Timer::Duration DELAYED_ACK_TIMEOUT = 20ms;
+  // The longest a peer may delay its ACK, waited for by a tail loss probe
+  // of a single segment (WCDelAckT, RFC 8985).
+  static constexpr Timer::Duration MAX_PEER_ACK_DELAY = 200ms;
+
+  /**
+   * @brief A congestion control algorithm, owned by a connection.
+   * The connection sends no more than `cwnd` bytes in flight (besides the
+   * peer's window), spaced by `pacingRate` if set, and reports ACKs and
+   * losses to the algorithm.
+   */
+  class CongestionControl {
+  public:
+    uint32_t cwnd;     // Congestion window, in bytes.
+    uint32_t ssthresh; // Slow start threshold, in bytes.
+    double pacingRate; // In bytes per second, 0 if not paced.
+
+    struct AckInfo {
+      uint32_t ackedLen;    // Bytes newly acknowledged.
+      uint32_t inFlight;    // Bytes in flight before the ACK.
+      uint32_t mss;         // The current send MSS.
+      Timer::Duration rtt;  // The RTT sampled by the ACK, 0 if none.
+      Timer::Duration srtt; // The smoothed RTT, 0 if not sampled yet.
+      Timer::TimePoint now;
+      bool inRecovery; // In fast recovery, where the window is held.
+      // Delivery rate sample: `rateDelivered` bytes in `rateInterval`
+      // (0 if none), since the acknowledged segment was sent.
+      uint64_t delivered;      // Total bytes delivered.
+      uint64_t priorDelivered; // `delivered` when the segment was sent.
+      uint64_t rateDelivered;
+      Timer::Duration rateInterval;
+    };
+
+    struct LossInfo {
+      uint32_t inFlight; // Bytes in flight when the loss is detected.
+      uint32_t mss;      // The current send MSS.
+      bool isTimeout;    // Detected by the retransmission timeout.
+      Timer::TimePoint now;
+    };
+
+    virtual ~CongestionControl() {}
+
+    /**
+     * @brief Get the name of the algorithm.
+     */
+    virtual const char *name() const = 0;
+
+    /**
+     * @brief Reset the state for a connection (being) established.
+     *
+     * @param mss The send MSS of the connection.
+     */
+    virtual void init(uint32_t mss);
+
+    /**
+     * @brief Handle an ACK of new data.
+     */
+    virtual void onAck(const AckInfo &info) = 0;
+
+    /**
+     * @brief Handle a loss, once per window of data.
+     */
+    virtual void onLoss(const LossInfo &info) = 0;
+  };
+
+  // Creates the congestion control of new connections (NewReno by default).
+  std::function<CongestionControl *()> newCongestionControl;
 
   class Connection : public Desc {
   public:
     Sock foreign;
+    // Send small segments without waiting for the ACK of the previous small
+    // one (TCP_NODELAY), disabling the Nagle algorithm.
+    bool noDelay;
 
   private:
     enum class St {
@@ -142,7 +232,7 @@ public:
       TIME_WAIT
     } state;
 
-    uint32_t mss;
+    uint32_t mss; // Effective send MSS, from the MTU and the peer's option.
     bool isReset;
 
     Connection(const Desc &desc, Sock foreign_);
@@ -166,6 +256,14 @@ public:
 
     int awaitClose() override;
 
+    /**
+     * @brief Replace the congestion control of the connection.
+     * To be called in the dispatcher of the stack.
+     *
+     * @param cc The congestion control, owned by the connection from now on.
+     */
+    void setCongestionControl(CongestionControl *cc);
+
   private:
     void notifyAll();
 
@@ -173,13 +271,22 @@ public:
 
     void advanceUnAck(uint32_t ack);
 
+    // Send what the windows allow, then wake the writers waiting for space.
     void checkSend();
 
+    // Send the data buffered as the windows, the pacing, the Nagle algorithm
+    // and SWS avoidance allow, then the FIN if queued after it.
+    void output();
+
     int sendSeg(const void *data, uint32_t dataLen, uint8_t ctrl, uint32_t seqNum);
 
     int sendSeg(const void *data, uint32_t dataLen, uint8_t ctrl);
 
-    void addSendSeg(const void *data, uint32_t dataLen, uint8_t ctrl);
+    // Send a new segment, of `dataLen` bytes buffered from `sndNxt`.
+    void addSendSeg(uint32_t dataLen, uint8_t ctrl);
+
+    // Send a segment of the data buffered from `seq`.
+    int sendData(uint32_t seq, uint32_t dataLen, uint8_t ctrl);
 
     void connect();
 
@@ -187,6 +294,10 @@ public:
 
     void deliverData(const void *data, uint32_t dataLen, uint32_t segSeq);
 
+    // Set `rcvWnd` by the free buffer space, moving the right edge by no
+    // less than an MSS or half the buffer (receiver SWS avoidance).
+    void updateRcvWnd();
+
     void parseOptions(const uint8_t *begin, const uint8_t *end);
 
     void handleRecvListen(Listener *listener, const void *data, size_t dataLen,
@@ -194,6 +305,10 @@ public:
 
     void handleRecv(const void *data, size_t dataLen, const RecvInfo &info);
 
+    // Acknowledge in-order data, at the end of the receive burst once two
+    // full segments are unacknowledged, or else by the delayed ACK timer.
+    void delayAck(uint32_t dataLen);
+
     using WaitHandler = std::function<void()>;
 
     struct SegInfo {
@@ -205,35 +320,146 @@ public:
     };
 
     struct SndSegInfo : public SegInfo {
-      void *data;
       uint32_t dataLen;
       uint8_t ctrl;
-      // TODO: timer
-      mutable Timer::Task *retrans;
+      mutable Timer::TimePoint sentTime; // Of the latest transmission
+      mutable bool isRetransmitted; // Not to be sampled (Karn's algorithm)
+      // The delivery state when sent, for delivery rate samples.
+      uint64_t delivered;
+      Timer::TimePoint deliveredTime, firstSentTime;
+      mutable bool isSacked;
     };
 
+    // Resend the unacknowledged part of a segment, split by the current MSS.
+    void retransmit(const SndSegInfo &seg);
+
+    // Follow a decrease of the path MTU to `mtu` reported for the segment at
+    // `seq`, resending the segments too large.
+    void handlePathMtu(uint32_t seq, size_t mtu);
+
+    // Update the RTO by a new round-trip time sample.
+    void sampleRtt(Timer::Duration rtt);
+
+    // The limit of bytes in flight, by the peer's and the congestion window.
+    uint32_t flightLimit() const;
+
+    // Bytes of a write of `dataLen` to be sent now, 0 if to wait for ACKs by
+    // the Nagle algorithm or sender SWS avoidance (RFC 1122).
+    uint32_t sendableLen(size_t dataLen);
+
+    // Whether the pacing rate allows sending now, waking `checkSend` when it
+    // does if not.
+    bool checkPacing();
+
+    // Count a duplicate ACK, entering fast recovery on the third.
+    void handleDupAck();
+
+    // Resend a segment now, restarting the timer if it is the oldest.
+    void fastRetransmit(const SndSegInfo &seg);
+
+    // Restart the retransmission timer by the oldest segment in flight, or
+    // stop it if nothing is.
+    void armRto();
+
+    // Resend the oldest segment on the retransmission timeout, backing off
+    // the timer, and go back to resend the rest as the window allows.
+    void handleRto();
+
+    // Update the scoreboard by the SACK option of an ACK.
+    void handleSack(const uint8_t *begin, const uint8_t *end);
+
+    // Mark the segments within a SACK block, walking only the part not
+    // SACKed before.
+    void markSacked(uint32_t begin, uint32_t end);
+
+    // Reduce the window and enter fast recovery, until `sndNxt` is acked.
+    void enterRecovery();
+
+    // Update RACK (RFC 8985) by a segment acknowledged or SACKed.
+    void rackUpdate(const SndSegInfo &seg, Timer::TimePoint now);
+
+    // Resend the segments sent a reordering window before the latest one
+    // delivered, waking up again for those not yet that old.
+    void rackDetectLoss();
+
+    // Restart the tail loss probe timer, if data is in flight.
+    void armTlp();
+
+    // Probe a zero window after `timeout`, doubling it for the next probe,
+    // until the window opens or data is in flight.
+    void persist(Timer::Duration timeout);
+
+    // Add a range to merged ranges, joining the overlapping and adjacent.
+    static void addBlock(OrdSet<SegInfo> &blocks, SegInfo block);
+
     uint32_t hRcv, tRcv, uRcv;
-    char rcvBuf[BUF_SIZE];
+    char *rcvBuf;
+    uint32_t rcvBufSize;
+    // A ring of the data from `sndUnAck` to `sndEnd`, unacknowledged or not
+    // sent yet.
+    char *sndBuf;
+    uint32_t sndBufSize;
+    uint32_t hSnd;    // Index of `sndUnAck` in `sndBuf`
+    uint32_t sndEnd;  // Past the last byte written
+    bool isFinQueued; // To be sent once the data buffered is
     Queue<WaitHandler> pdSnd, pdRcv, onEstab, onClose;
-    OrdSet<SegInfo> rcvInfo;
+    OrdSet<SegInfo> rcvInfo; // Ranges received beyond `rcvNxt`, merged
     OrdSet<SndSegInfo> sndInfo;
+    OrdSet<SegInfo> sackInfo; // Ranges SACKed by the peer, merged
 
     Timer::Task *timeWait;
 
     uint32_t sndUnAck;  // send unacknowledged
     uint32_t sndNxt;    // send next
     uint32_t sndWnd;    // send window
+    uint32_t maxSndWnd; // largest send window offered by the peer
+    uint32_t sndSmlEnd; // end of the last segment shorter than the MSS
     uint32_t sndUrgPtr; // send urgent pointer
     // segment sequence number used for last window update
     uint32_t sndWndUpdSeq;
     // segment acknowledgment number used for last window update
     uint32_t sndWndUpdAck;
     uint32_t initSndSeq; // initial send sequence number
+    Timer::Duration srtt, rttVar, rto; // 0 `srtt` if not sampled yet
+    CongestionControl *cc;
+    uint32_t recover; // `sndNxt` at the last loss, reacted once per window
+    uint32_t rtxNxt;  // Next to resend after a timeout, up to `recover`
+    Timer::Task *rtoTimer;
+    bool isRtoBackoff; // Timed out, with no ACK progress since
+    uint32_t dupAcks;
+    bool inRecovery;    // Fast recovery until `recover` is acknowledged
+    // Segments known to have left the network in fast recovery, in bytes.
+    uint32_t inflation;
+    uint32_t sackedBytes; // Of the segments in `sndInfo`
+    Timer::Duration minRtt;
+    // The segment sent latest of those delivered, by RACK.
+    Timer::TimePoint rackXmitTime;
+    uint32_t rackEndSeq;
+    Timer::Duration rackRtt;
+    Timer::Task *rackTimer, *tlpTimer;
+    Timer::Task *persistTimer;
+    uint64_t delivered; // Bytes acknowledged in total
+    // When `delivered` last grew, and when the segment last acked was sent.
+    Timer::TimePoint deliveredTime, firstSentTime;
+    Timer::TimePoint nextSendTime; // Earliest new segment by the pacing rate
+    Timer::Task *paceTimer;
+    uint8_t sndWndShift; // scale of the windows received
+
+    // Window scaling and SACK offered (until the SYN-ACK) or agreed.
+    bool wndScale, sackOk;
 
     uint32_t rcvNxt;     // receive next
     uint32_t rcvWnd;     // receive window
+    uint32_t rcvWndEdge; // `rcvNxt + rcvWnd` as last advertised
     uint32_t rcvUrgPtr;  // receive urgent pointer
     uint32_t initRcvSeq; // initial receive sequence number
+    uint32_t lastRcvSeq; // latest segment out of order, SACKed first
+    uint32_t rcvUnAcked; // Bytes received in order and not acknowledged
+    Timer::Task *delAckTimer;
+    bool isAckDue;     // To be acknowledged at the end of the receive burst
+    bool isSmlUnAcked; // A segment shorter than the MSS among `rcvUnAcked`
+    bool isAckQueued;  // In `TCP::ackDue`
+    uint8_t rcvWndShift; // scale of the windows sent
   };
 
   /**
@@ -273,13 +499,30 @@ private:
   static bool seqLe(uint32_t a, uint32_t b);
 
   int sendSeg(const void *data, size_t dataLen, const Header &header,
-              L3::Addr src, L3::Addr dst);
+              L3::Addr src, L3::Addr dst, const void *options = nullptr,
+              size_t optionsLen = 0);
+
+  // Passes ICMP fragmentation needed messages to the connections.
+  class IcmpHandler : public ICMP::RecvCallback {
+    TCP &tcp;
+
+  public:
+    IcmpHandler(TCP &tcp_);
+
+    int handle(const void *data, int dataLen, const Info &info) override;
+  } icmpHandler;
 
   void handleRecvClosed(const void *data, size_t dataLen, const RecvInfo &info);
 
   void handleRecv(const void *seg, size_t tcpLen, const L3::RecvInfo &info);
 
   void removeConnection(Connection *conn);
+
+  // Connections to be acknowledged at the end of the receive burst, so that
+  // the segments of one burst are acknowledged together.
+  Vector<Connection *> ackDue;
+
+  void flushAcks();
 };
 
 #endif
@@ -41,11 +41,13 @@ public:
    * @param srcPort Source port.
    * @param dstAddr IP address of the destination.
    * @param dstPort Destination port.
+   * @param device The device to send through, `nullptr` for any (routed).
    * @return 0 on success, negative on error.
    * Including: E_WAIT_FOR_TRYAGAIN (but will auto retry).
    */
   int sendSegment(const void *data, int dataLen, L3::Addr srcAddr, int srcPort,
-                  L3::Addr dstAddr, int dstPort);
+                  L3::Addr dstAddr, int dstPort,
+                  L3::L2::Device *device = nullptr);
 
   struct RecvInfo {
     L3::RecvInfo l3;
@@ -1,3 +1,5 @@
+#include <cstdlib>
+
 #include <arpa/inet.h>
 
 #include "ARP.h"
@@ -10,41 +12,155 @@ const HashMap<ARP::L3::Addr, ARP::TabEntry> &ARP::getTable() {
   return table;
 }
 
-int ARP::sendRequest(L3::Addr target) {
-  int rc = 0;
-  for (auto &&e : l3.getAddrs()) {
-    Packet packet{.hrd = htons(HRD),
-                  .pro = htons(PRO),
-                  .hln = HLN,
-                  .pln = PLN,
-                  .op = htons(OP_REQUEST),
-                  .sha = e.device->addr,
-                  .spa = e.addr,
-                  .tha = {0},
-                  .tpa = target};
-    int rc1 =
-        l2.send(&packet, sizeof(Packet), L2::BROADCAST, PROTOCOL_ID, e.device);
-    if (rc1 < 0)
-      rc = rc1;
+int ARP::sendRequest(L3::Addr target, const TabEntry &entry) {
+  L3::Addr srcAddr;
+  if (l3.getAnyAddr(entry.device, srcAddr) < 0) {
+    LOG_ERR("No IP address to send ARP request");
+    return -1;
+  }
+  // Broadcast to resolve, or unicast to probe a known neighbor.
+  bool probing = entry.state == State::PROBE;
+  Packet packet{.hrd = htons(HRD),
+                .pro = htons(PRO),
+                .hln = HLN,
+                .pln = PLN,
+                .op = htons(OP_REQUEST),
+                .sha = entry.device->addr,
+                .spa = srcAddr,
+                .tha = probing ? entry.linkAddr : L2::Addr{0},
+                .tpa = target};
+  return l2.send(&packet, sizeof(Packet),
+                 probing ? entry.linkAddr : L2::BROADCAST, PROTOCOL_ID,
+                 entry.device);
+}
+
+void ARP::startTimer(L3::Addr target, TabEntry &entry,
+                     Timer::Duration timeout) {
+  if (entry.timer)
+    netBase.timer.remove(entry.timer);
+  entry.timer =
+      netBase.timer.add([this, target]() { handleTimer(target); }, timeout);
+}
+
+void ARP::handleTimer(L3::Addr target) {
+  auto it = table.find(target);
+  if (it == table.end())
+    return;
+  auto &&e = it->second;
+  e.timer = nullptr;
+  switch (e.state) {
+  case State::INCOMPLETE:
+  case State::PROBE:
+    if (e.nRequests >= MAX_REQUESTS) {
+      removeEntry(it);
+      break;
+    }
+    sendRequest(target, e);
+    // Back off exponentially: 1s, 2s, 4s, ... by default.
+    startTimer(target, e, RETRANS_TIME * (1 << e.nRequests++));
+    break;
+  case State::REACHABLE:
+    if (e.used) {
+      // Confirm a neighbor in use in the background, before it goes stale.
+      e.state = State::PROBE;
+      e.nRequests = 1;
+      e.used = false;
+      sendRequest(target, e);
+      startTimer(target, e, RETRANS_TIME);
+      break;
+    }
+    e.state = State::STALE;
+    startTimer(target, e, EXPIRE_CYCLE - REACHABLE_TIME);
+    break;
+  case State::STALE:
+    removeEntry(it);
+    break;
+  }
+}
+
+void ARP::removeEntry(HashMap<L3::Addr, TabEntry>::iterator it) {
+  L3::Addr target = it->first;
+  auto &&e = it->second;
+  for (auto &&q : e.queue)
+    free(q.packet);
+  if (e.timer)
+    netBase.timer.remove(e.timer);
+  bool resolving = e.state == State::INCOMPLETE;
+  table.erase(it);
+  if (resolving)
+    notifyWaiting(target, false);
+}
+
+void ARP::notifyWaiting(L3::Addr target, bool succ) {
+  auto r = waiting.equal_range(target);
+  for (auto it = r.first; it != r.second; it++) {
+    it->second.handler(succ);
+    netBase.timer.remove(it->second.expire);
+  }
+  waiting.erase(r.first, r.second);
+}
+
+int ARP::query(L3::Addr target, L2::Device *device, L2::Addr &res) {
+  auto it = table.find(target);
+  if (it == table.end()) {
+    // Only one request is outstanding for a neighbor, retried by the timer.
+    TabEntry entry{.linkAddr = {0},
+                   .device = device,
+                   .state = State::INCOMPLETE,
+                   .nRequests = 1,
+                   .used = false,
+                   .timer = nullptr};
+    int rc = sendRequest(target, entry);
+    if (rc != 0)
+      return rc;
+    it = table.insert({target, entry}).first;
+    startTimer(target, it->second, RETRANS_TIME);
+    return E_WAIT_FOR_TRYAGAIN;
   }
-  return rc;
+
+  auto &&e = it->second;
+  switch (e.state) {
+  case State::INCOMPLETE:
+    return E_WAIT_FOR_TRYAGAIN;
+  case State::STALE:
+    // Keep using it while confirming.
+    e.state = State::PROBE;
+    e.nRequests = 1;
+    sendRequest(target, e);
+    startTimer(target, e, RETRANS_TIME);
+    break;
+  default:
+    break;
+  }
+  e.used = true;
+  res = e.linkAddr;
+  return 0;
 }
 
-int ARP::query(L3::Addr target, L2::Addr &res) {
-  time_t curTime = time(nullptr);
-  auto p = table.find(target);
-  if (p != table.end()) {
-    res = p->second.linkAddr;
-    return 0;
+void ARP::enqueue(L3::Addr target, void *packet, size_t packetLen,
+                  Timer::Duration timeout) {
+  auto it = table.find(target);
+  if (it == table.end() || it->second.state != State::INCOMPLETE) {
+    // Resolved (or failed) in between.
+    if (it != table.end())
+      l2.send(packet, packetLen, it->second.linkAddr, L3::PROTOCOL_ID,
+              it->second.device);
+    free(packet);
+    return;
+  }
+  auto &&queue = it->second.queue;
+  if (queue.size() == QUEUE_LEN) {
+    free(queue.front().packet);
+    queue.erase(queue.begin());
   }
-  int rc = sendRequest(target);
-  if (rc != 0)
-    return rc;
-  return E_WAIT_FOR_TRYAGAIN;
+  queue.push_back({.packet = packet,
+                   .packetLen = packetLen,
+                   .deadline = Timer::Clock::now() + timeout});
 }
 
 void ARP::addWait(L3::Addr addr, WaitHandler handler, Timer::Duration timeout) {
-  if (table.count(addr)) {
+  auto p = table.find(addr);
+  if (p != table.end() && p->second.state != State::INCOMPLETE) {
     handler(true);
   } else {
     auto it = waiting.insert({addr, WaitingEntry{.handler = handler}});
@@ -57,6 +173,69 @@ void ARP::addWait(L3::Addr addr, WaitHandler handler, Timer::Duration timeout) {
   }
 }
 
+int ARP::announce(L3::Addr addr, L2::Device *device) {
+  Packet packet{.hrd = htons(HRD),
+                .pro = htons(PRO),
+                .hln = HLN,
+                .pln = PLN,
+                .op = htons(OP_REQUEST),
+                .sha = device->addr,
+                .spa = addr,
+                .tha = {0},
+                .tpa = addr};
+  return l2.send(&packet, sizeof(Packet), L2::BROADCAST, PROTOCOL_ID, device);
+}
+
+void ARP::addStale(L3::Addr addr, L2::Addr linkAddr, L2::Device *device) {
+  learn(addr, linkAddr, device, false, true);
+}
+
+void ARP::learn(L3::Addr addr, L2::Addr linkAddr, L2::Device *device,
+                bool confirmed, bool create) {
+  auto it = table.find(addr);
+  bool isNew = it == table.end();
+  if (isNew) {
+    if (!create)
+      return;
+    it = table
+             .insert({addr, TabEntry{.device = device,
+                                     .state = State::INCOMPLETE,
+                                     .nRequests = 0,
+                                     .used = false,
+                                     .timer = nullptr}})
+             .first;
+  }
+  auto &&e = it->second;
+  bool resolving = e.state == State::INCOMPLETE;
+  // Only a reply we asked for confirms: not one creating the entry.
+  bool asked = !isNew && (resolving || e.state == State::PROBE);
+  if (confirmed && asked) {
+    e.state = State::REACHABLE;
+    startTimer(addr, e, REACHABLE_TIME);
+  } else if (resolving || e.linkAddr != linkAddr) {
+    // Not a proof of reachability, but a better guess.
+    e.state = State::STALE;
+    startTimer(addr, e, EXPIRE_CYCLE);
+  } else {
+    return;
+  }
+  e.linkAddr = linkAddr;
+  e.device = device;
+  e.nRequests = 0;
+  e.used = false;
+
+  if (resolving) {
+    auto now = Timer::Clock::now();
+    for (auto &&q : e.queue) {
+      if (now <= q.deadline)
+        l2.send(q.packet, q.packetLen, e.linkAddr, L3::PROTOCOL_ID, e.device);
+      free(q.packet);
+    }
+    e.queue.clear();
+    notifyWaiting(addr, true);
+  }
+}
+
 int ARP::setup() {
   l2.addOnRecv(
       [this](auto &&...args) -> int {
@@ -78,36 +257,25 @@ void ARP::handleRecv(const void *buf, size_t len, const L2::RecvInfo &info) {
                .hln = HLN,
                .pln = PLN,
                .op = htons(OP_RESPONSE)};
-  if (packet.hrd == reply.hrd && packet.pro == reply.pro &&
-      packet.hln == reply.hln && packet.pln == reply.pln) {
-    if (packet.op == htons(OP_REQUEST)) {
-      for (auto &&e : l3.getAddrs())
-        if (packet.tpa == e.addr) {
-          reply.tha = packet.sha;
-          reply.tpa = packet.spa;
-          reply.spa = e.addr;
-          reply.sha = info.device->addr;
-          l2.send(&reply, sizeof(Packet), packet.sha, PROTOCOL_ID, info.device);
-        }
-
-    } else if (packet.op == htons(OP_RESPONSE)) {
-      time_t curTime = time(nullptr);
-      auto it = table.find(packet.spa);
-      if (it != table.end()) {
-        if (it->second.expire)
-          netBase.timer.remove(it->second.expire);
-      } else {
-        it = table.insert({packet.spa, {}}).first;
-      }
-      it->second = {.linkAddr = packet.sha,
-                    .expire = netBase.timer.add(
-                        [this, it]() { table.erase(it); }, EXPIRE_CYCLE)};
-      auto r = waiting.equal_range(packet.spa);
-      for (auto it = r.first; it != r.second; it++) {
-        it->second.handler(true);
-        netBase.timer.remove(it->second.expire);
-      }
-      waiting.erase(r.first, r.second);
-    }
+  if (packet.hrd != reply.hrd || packet.pro != reply.pro ||
+      packet.hln != reply.hln || packet.pln != reply.pln)
+    return;
+  bool isRequest = packet.op == htons(OP_REQUEST);
+  if (!isRequest && packet.op != htons(OP_RESPONSE))
+    return;
+
+  // Learn the sender from ARP to us: confirmed by replies to our requests,
+  // stale otherwise. Known ones are updated by any (including gratuitous)
+  // ARP, as stale if the link address changed.
+  bool toUs = l3.findDeviceByAddr(packet.tpa) != nullptr;
+  if (packet.spa != L3::Addr{0} && !l3.findDeviceByAddr(packet.spa))
+    learn(packet.spa, packet.sha, info.device, !isRequest && toUs, toUs);
+
+  if (isRequest && toUs) {
+    reply.tha = packet.sha;
+    reply.tpa = packet.spa;
+    reply.spa = packet.tpa;
+    reply.sha = info.device->addr;
+    l2.send(&reply, sizeof(Packet), packet.sha, PROTOCOL_ID, info.device);
   }
 }
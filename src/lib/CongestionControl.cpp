@@ -0,0 +1,258 @@
+#include <algorithm>
+#include <cmath>
+
+#include "CongestionControl.h"
+
+const char *NewReno::name() const {
+  return "newreno";
+}
+
+void NewReno::init(uint32_t mss) {
+  CongestionControl::init(mss);
+  ackedBytes = 0;
+}
+
+void NewReno::onAck(const AckInfo &info) {
+  // Not limited by the window, which is then not probed.
+  if (info.inRecovery || info.inFlight + info.mss < cwnd)
+    return;
+  if (cwnd < ssthresh) {
+    // Appropriate byte counting (RFC 3465), L = 2.
+    cwnd += std::min(info.ackedLen, 2 * info.mss);
+    return;
+  }
+  ackedBytes += info.ackedLen;
+  if (ackedBytes >= cwnd) {
+    ackedBytes -= cwnd;
+    cwnd += info.mss;
+  }
+}
+
+void NewReno::onLoss(const LossInfo &info) {
+  ssthresh = std::max(info.inFlight / 2, 2 * info.mss);
+  cwnd = info.isTimeout ? info.mss : ssthresh;
+  ackedBytes = 0;
+}
+
+const char *Cubic::name() const {
+  return "cubic";
+}
+
+void Cubic::init(uint32_t mss) {
+  CongestionControl::init(mss);
+  wMax = 0;
+  wEst = 0;
+  k = 0;
+  cwndInc = 0;
+  inEpoch = false;
+}
+
+void Cubic::onAck(const AckInfo &info) {
+  if (info.inRecovery || info.inFlight + info.mss < cwnd)
+    return;
+  if (cwnd < ssthresh) {
+    cwnd += std::min(info.ackedLen, 2 * info.mss);
+    return;
+  }
+
+  double segs = (double)cwnd / info.mss;
+  if (!inEpoch) {
+    inEpoch = true;
+    epochStart = info.now;
+    wEst = segs;
+    if (segs < wMax) {
+      k = std::cbrt((wMax - segs) / C);
+    } else {
+      k = 0;
+      wMax = segs;
+    }
+  }
+
+  // The window one RTT ahead, clamped to [cwnd, 1.5 cwnd].
+  double t = std::chrono::duration<double>(info.now - epochStart + info.srtt)
+                 .count();
+  double target = C * (t - k) * (t - k) * (t - k) + wMax;
+  target = std::min(std::max(target, segs), segs * 1.5);
+
+  // Not slower than NewReno would be (the Reno-friendly region).
+  double alpha = wEst < wMax ? 3 * (1 - BETA) / (1 + BETA) : 1;
+  wEst += alpha * info.ackedLen / info.mss / segs;
+
+  if (target < wEst) {
+    cwnd = std::max(cwnd, (uint32_t)wEst * info.mss);
+  } else {
+    cwndInc += (target - segs) / segs * info.ackedLen;
+    while (cwndInc >= info.mss) {
+      cwnd += info.mss;
+      cwndInc -= info.mss;
+    }
+  }
+}
+
+void Cubic::onLoss(const LossInfo &info) {
+  double segs = (double)cwnd / info.mss;
+  // Fast convergence: release bandwidth to newer flows.
+  wMax = segs < wMax ? segs * (1 + BETA) / 2 : segs;
+  ssthresh = std::max((uint32_t)(cwnd * BETA), 2 * info.mss);
+  cwnd = info.isTimeout ? info.mss : ssthresh;
+  cwndInc = 0;
+  inEpoch = false;
+}
+
+const char *Bbr::name() const {
+  return "bbr";
+}
+
+void Bbr::init(uint32_t mss) {
+  CongestionControl::init(mss);
+  mode = Mode::STARTUP;
+  pacingGain = cwndGain = HIGH_GAIN;
+  // Paced by the initial window over an assumed 1ms RTT until sampled.
+  pacingRate = HIGH_GAIN * cwnd / 1e-3;
+  btlBw = 0;
+  for (auto &&bw : bwRounds)
+    bw = 0;
+  minRtt = Timer::Duration(0);
+  isMinRttExpired = false;
+  round = nextRoundDelivered = 0;
+  isRoundStart = false;
+  fullBw = 0;
+  fullBwRounds = 0;
+  isFullPipe = false;
+  cycleIndex = 0;
+  probeRttDone = Timer::TimePoint();
+  priorCwnd = cwnd;
+}
+
+uint32_t Bbr::bdp(double gain, uint32_t mss) const {
+  double bytes = btlBw * std::chrono::duration<double>(minRtt).count();
+  return std::max((uint32_t)(gain * bytes), MIN_CWND_SEGS * mss);
+}
+
+void Bbr::updateModel(const AckInfo &info) {
+  // A round trip ends when a segment sent after its start is acknowledged.
+  isRoundStart = info.priorDelivered >= nextRoundDelivered;
+  if (isRoundStart) {
+    nextRoundDelivered = info.delivered;
+    round++;
+    bwRounds[round % BW_ROUNDS] = 0;
+  }
+
+  isMinRttExpired = minRtt > Timer::Duration(0) &&
+                    info.now > minRttStamp + MIN_RTT_WINDOW;
+  if (info.rtt > Timer::Duration(0) &&
+      (minRtt == Timer::Duration(0) || info.rtt <= minRtt ||
+       isMinRttExpired)) {
+    minRtt = info.rtt;
+    minRttStamp = info.now;
+  }
+
+  // Samples over less than the min RTT are bursts of ACKs.
+  if (info.rateInterval > Timer::Duration(0) && info.rateInterval >= minRtt) {
+    double bw = info.rateDelivered /
+                std::chrono::duration<double>(info.rateInterval).count();
+    double &roundBw = bwRounds[round % BW_ROUNDS];
+    roundBw = std::max(roundBw, bw);
+    btlBw = *std::max_element(bwRounds, bwRounds + BW_ROUNDS);
+  }
+}
+
+void Bbr::enterProbeBw(Timer::TimePoint now) {
+  mode = Mode::PROBE_BW;
+  pacingGain = 1;
+  cwndGain = CWND_GAIN;
+  // Not to start by draining.
+  cycleIndex = CYCLE_LEN - 1;
+  cycleStamp = now;
+}
+
+void Bbr::updateMode(const AckInfo &info) {
+  static constexpr double CYCLE_GAINS[CYCLE_LEN] = {1.25, 0.75, 1, 1,
+                                                    1,    1,    1, 1};
+  uint32_t inFlight = info.inFlight - std::min(info.inFlight, info.ackedLen);
+
+  // The bandwidth stops growing by a quarter for 3 rounds: the pipe is full.
+  if (mode == Mode::STARTUP && isRoundStart && btlBw > 0) {
+    if (btlBw >= fullBw * 1.25) {
+      fullBw = btlBw;
+      fullBwRounds = 0;
+    } else if (++fullBwRounds >= 3) {
+      isFullPipe = true;
+      mode = Mode::DRAIN;
+      pacingGain = 1 / HIGH_GAIN;
+      cwndGain = HIGH_GAIN;
+    }
+  }
+  if (mode == Mode::DRAIN && inFlight <= bdp(1, info.mss))
+    enterProbeBw(info.now);
+
+  if (mode == Mode::PROBE_BW) {
+    // A phase lasts a min RTT, but probing goes on until the queue is built
+    // and draining stops once it is gone.
+    double gain = CYCLE_GAINS[cycleIndex];
+    bool isDue = info.now - cycleStamp > minRtt;
+    if (gain > 1)
+      isDue = isDue && inFlight >= bdp(gain, info.mss);
+    else if (gain < 1)
+      isDue = isDue || inFlight <= bdp(1, info.mss);
+    if (isDue) {
+      cycleIndex = (cycleIndex + 1) % CYCLE_LEN;
+      cycleStamp = info.now;
+      pacingGain = CYCLE_GAINS[cycleIndex];
+    }
+  }
+
+  if (mode != Mode::PROBE_RTT && isMinRttExpired) {
+    mode = Mode::PROBE_RTT;
+    pacingGain = cwndGain = 1;
+    priorCwnd = cwnd;
+    probeRttDone = Timer::TimePoint();
+  }
+  if (mode == Mode::PROBE_RTT) {
+    if (probeRttDone == Timer::TimePoint() &&
+        inFlight <= MIN_CWND_SEGS * info.mss)
+      probeRttDone = info.now + std::max(PROBE_RTT_TIME, minRtt);
+    if (probeRttDone != Timer::TimePoint() && info.now > probeRttDone) {
+      minRttStamp = info.now;
+      cwnd = std::max(cwnd, priorCwnd);
+      if (isFullPipe) {
+        enterProbeBw(info.now);
+      } else {
+        mode = Mode::STARTUP;
+        pacingGain = cwndGain = HIGH_GAIN;
+      }
+    }
+  }
+}
+
+void Bbr::onAck(const AckInfo &info) {
+  updateModel(info);
+  updateMode(info);
+
+  if (btlBw > 0) {
+    double rate = pacingGain * btlBw;
+    // Not to slow down before the pipe is full.
+    if (isFullPipe || rate > pacingRate)
+      pacingRate = rate;
+  } else if (info.srtt > Timer::Duration(0)) {
+    pacingRate =
+        HIGH_GAIN * cwnd / std::chrono::duration<double>(info.srtt).count();
+  }
+
+  // Grow towards the target by the data delivered.
+  uint32_t target = bdp(cwndGain, info.mss) + 3 * info.mss;
+  if (isFullPipe)
+    cwnd = std::min(cwnd + info.ackedLen, target);
+  else if (cwnd < target || btlBw == 0)
+    cwnd += info.ackedLen;
+  if (mode == Mode::PROBE_RTT)
+    cwnd = std::min(cwnd, MIN_CWND_SEGS * info.mss);
+  cwnd = std::max(cwnd, MIN_CWND_SEGS * info.mss);
+}
+
+void Bbr::onLoss(const LossInfo &info) {
+  // Random losses say nothing of the bandwidth. After a timeout, restart
+  // from one segment and regrow to the model by the data delivered.
+  if (info.isTimeout)
+    cwnd = info.mss;
+}
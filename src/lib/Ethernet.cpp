@@ -4,6 +4,9 @@
 
 #include <pcap/pcap.h>
 
+#include <net/if.h>
+#include <sys/ioctl.h>
+
 #include <linux/if_arp.h>
 #include <linux/if_packet.h>
 
@@ -15,8 +18,30 @@ constexpr Ethernet::Addr Ethernet::BROADCAST;
 
 Ethernet::Ethernet(NetBase &netBase_) : netBase(netBase_) {}
 
-Ethernet::Device::Device(pcap_t *p_, const char *name_, const Addr &addr_)
-    : NetBase::Device(p_, name_, LINK_TYPE), addr(addr_) {}
+Ethernet::Device::Device(pcap_t *p_, const char *name_, const Addr &addr_,
+                         size_t mtu_)
+    : NetBase::Device(p_, name_, LINK_TYPE), addr(addr_), mtu(mtu_) {}
+
+/**
+ * @brief Get the MTU of a device from the kernel.
+ *
+ * The query goes through the activated capture handle itself, for no other
+ * socket to be opened (which the socket wrapper would take for its own).
+ *
+ * @param p Activated capture handle of the device.
+ * @param name Name of the device.
+ * @return The MTU, `DEFAULT_MTU` if not available.
+ */
+static size_t getDeviceMtu(pcap_t *p, const char *name) {
+  ifreq ifr{};
+  strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+  int fd = pcap_fileno(p);
+  if (fd < 0 || ioctl(fd, SIOCGIFMTU, &ifr) != 0 || ifr.ifr_mtu <= 0) {
+    LOG_INFO("Unknown MTU of %s, assuming %lu", name, Ethernet::DEFAULT_MTU);
+    return Ethernet::DEFAULT_MTU;
+  }
+  return ifr.ifr_mtu;
+}
 
 Ethernet::Device *Ethernet::addDeviceByName(const char *name) {
   if (netBase.findDeviceByName(name)) {
@@ -85,7 +110,7 @@ Ethernet::Device *Ethernet::addDeviceByName(const char *name) {
     goto CLOSE;
   }
 
-  d = new Device(p, name, addr);
+  d = new Device(p, name, addr, getDeviceMtu(p, name));
   netBase.addDevice(d);
   return d;
 
@@ -100,8 +125,9 @@ Ethernet::Device *Ethernet::findDeviceByName(const char *name) {
 
 int Ethernet::send(const void *data, size_t dataLen, Addr dst,
                    uint16_t etherType, Device *dev) {
-  if (dataLen > SIZE_MAX - sizeof(Header)) {
-    LOG_ERR("Ethernet data length too large: %lu", dataLen);
+  if (dataLen > dev->mtu) {
+    LOG_ERR("Ethernet data length exceeds the MTU of %s: %lu/%lu", dev->name,
+            dataLen, dev->mtu);
     return -1;
   }
 
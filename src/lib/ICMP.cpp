@@ -15,6 +15,25 @@ ICMP::ICMP(IP &ip_) : ip(ip_) {}
 
 int ICMP::sendTimeExceeded(const void *orig, int origLen,
                            const IP::RecvInfo &info) {
+  return sendError(Header{type : 11, code : 0, checksum : 0, 0}, orig, origLen,
+                   info.l2.device, info.l2.header->src);
+}
+
+int ICMP::sendDestUnreachable(const void *orig, int origLen, int code,
+                              uint16_t nextHopMtu, IP::L2::Device *device,
+                              IP::L2::Addr srcMAC) {
+  Header header{
+    type : 3,
+    code : (uint8_t)code,
+    checksum : 0,
+    identifier : 0,
+    seqNumber : htons(nextHopMtu)
+  };
+  return sendError(header, orig, origLen, device, srcMAC);
+}
+
+int ICMP::sendError(const Header &errHeader, const void *orig, int origLen,
+                    IP::L2::Device *device, IP::L2::Addr srcMAC) {
   const IP::Header &origHeader = *(const IP::Header *)orig;
 
   int origHdrLen = (origHeader.versionAndIHL & 0x0F) * 4;
@@ -24,7 +43,7 @@ int ICMP::sendTimeExceeded(const void *orig, int origLen,
   int msgLen = sizeof(Header) + backLen;
 
   IP::Addr src;
-  int rc = ip.getAnyAddr(info.l2.device, src);
+  int rc = ip.getAnyAddr(device, src);
   if (rc < 0) {
     ERRLOG("No IP address on the host.\n");
     return rc;
@@ -37,7 +56,8 @@ int ICMP::sendTimeExceeded(const void *orig, int origLen,
   }
 
   Header &header = *(Header *)msg;
-  header = Header{type : 11, code : 0, checksum : 0, 0};
+  header = errHeader;
+  header.checksum = 0;
   memcpy(&header + 1, orig, backLen);
   header.checksum = csum16(msg, msgLen);
 #ifdef NETSTACK_DEBUG
@@ -45,7 +65,7 @@ int ICMP::sendTimeExceeded(const void *orig, int origLen,
 #endif
 
   rc = ip.send(msg, msgLen, src, origHeader.src, PROTOCOL_ID,
-                     {.device = info.l2.device, .dstMAC = info.l2.header->src});
+               {.device = device, .dstMAC = srcMAC});
   free(msg);
   return rc;
 }
@@ -159,3 +179,24 @@ void ICMP::handleRecv(const void *msg, size_t msgLen,
       c->handle(data, dataLen, newInfo);
     }
 }
+
+size_t ICMP::getFragNeededMtu(const Header &header, const void *data,
+                              int dataLen) {
+  if (dataLen < (int)sizeof(IP::Header))
+    return 0;
+  const IP::Header &orig = *(const IP::Header *)data;
+  size_t mtu = ntohs(header.seqNumber);
+  if (mtu == 0) {
+    // From an old router not reporting it: guess the next plateau below the
+    // original length (RFC 1191 section 7).
+    static const size_t PLATEAUS[] = {32000, 17914, 8166, 4352, 2002,
+                                      1492,  1006,  508,  296,  68};
+    size_t origLen = ntohs(orig.totalLength);
+    for (size_t p : PLATEAUS)
+      if (p < origLen) {
+        mtu = p;
+        break;
+      }
+  }
+  return mtu;
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <cstdlib>
@@ -17,29 +18,44 @@ constexpr IP::Addr IP::BROADCAST;
 
 IP::IP(L2 &l2_)
     : l2(l2_), routing(nullptr), icmp(*(new ICMP(*this))),
-      arp(*(new ARP(l2, *this))) {}
+      arp(*(new ARP(l2, *this))), nextId(0), reassemblyMem(0) {}
 
 IP::~IP() {
+  while (!reassemblies.empty())
+    removeReassembly(reassemblies.begin());
   delete &icmp;
   delete &arp;
 }
 
 void IP::addAddr(DevAddr entry) {
   addrs.push_back(entry);
+  deviceAddrs[entry.device].push_back(entry);
+  // The first assigned one wins, as when scanning `addrs`.
+  auto &&local = localAddrs[entry.addr];
+  if (!local.device)
+    local.device = entry.device;
+  auto &&broadcast = localAddrs[entry.addr | ~entry.mask];
+  if (!broadcast.broadcastDevice)
+    broadcast.broadcastDevice = entry.device;
+  arp.announce(entry.addr, entry.device);
 }
 
 const Vector<IP::DevAddr> &IP::getAddrs() {
   return addrs;
 }
 
+const HashMap<IP::L2::Device *, Vector<IP::DevAddr>> &IP::getDeviceAddrs() {
+  return deviceAddrs;
+}
+
 int IP::getAnyAddr(L2::Device *device, Addr &res) {
   if (addrs.empty())
     return -1;
-  for (auto &&e : addrs)
-    if (e.device == device) {
-      res = e.addr;
-      return 0;
-    }
+  auto it = deviceAddrs.find(device);
+  if (it != deviceAddrs.end()) {
+    res = it->second.front().addr;
+    return 0;
+  }
   res = addrs.front().addr;
   return 1;
 }
@@ -54,11 +70,78 @@ int IP::getSrcAddr(Addr dst, Addr &res) {
   return getAnyAddr(hop.device, res);
 }
 
+size_t IP::getDeviceMtu(Addr dst) {
+  L2::Device *device = findDeviceByBroadcast(dst);
+  Routing::HopInfo hop;
+  if (!device && routing && routing->query(dst, hop) == 0)
+    device = hop.device;
+  return device ? device->mtu : L2::DEFAULT_MTU;
+}
+
+size_t IP::getMtu(Addr dst) {
+  size_t mtu = getDeviceMtu(dst);
+  if (pathMtus.empty())
+    return mtu;
+  auto it = pathMtus.find(dst);
+  if (it != pathMtus.end()) {
+    if (it->second.expireTime <= Timer::Clock::now())
+      pathMtus.erase(it);
+    else
+      mtu = std::min(mtu, it->second.mtu);
+  }
+  return mtu;
+}
+
+int IP::lowerPathMtu(Addr dst, size_t mtu) {
+  mtu = std::max(mtu, MIN_MTU);
+  if (mtu >= getMtu(dst))
+    return 1;
+  auto now = Timer::Clock::now();
+  if (pathMtus.size() >= MAX_PATH_MTUS && !pathMtus.count(dst)) {
+    for (auto it = pathMtus.begin(); it != pathMtus.end();)
+      if (it->second.expireTime <= now)
+        it = pathMtus.erase(it);
+      else
+        it++;
+    if (pathMtus.size() >= MAX_PATH_MTUS)
+      return 1;
+  }
+  pathMtus[dst] = {mtu, now + PATH_MTU_TIMEOUT};
+  LOG_INFO("Path MTU to " IP_ADDR_FMT_STRING ": %lu", IP_ADDR_FMT_ARGS(dst),
+           mtu);
+  return 0;
+}
+
 IP::L2::Device *IP::findDeviceByAddr(Addr addr) {
-  for (auto &&a : addrs)
-    if (a.addr == addr)
-      return a.device;
-  return nullptr;
+  auto it = localAddrs.find(addr);
+  return it != localAddrs.end() ? it->second.device : nullptr;
+}
+
+IP::L2::Device *IP::findDeviceByBroadcast(Addr addr) {
+  auto it = localAddrs.find(addr);
+  return it != localAddrs.end() ? it->second.broadcastDevice : nullptr;
+}
+
+uint32_t IP::flowHash(const void *packet, size_t packetLen) {
+  const Header &header = *(const Header *)packet;
+  size_t hdrLen = (header.versionAndIHL & 0x0f) * 4;
+  uint64_t h = (uint64_t)header.src.num << 32 | header.dst.num;
+  h ^= (uint64_t)header.protocol << 56;
+  // Ports are only in the first fragment.
+  if ((header.protocol == IPPROTO_TCP || header.protocol == IPPROTO_UDP) &&
+      (ntohs(header.flagsAndFragmentOffset) & 0x1fff) == 0 &&
+      packetLen >= hdrLen + 4) {
+    uint32_t ports;
+    memcpy(&ports, (const char *)packet + hdrLen, sizeof(ports));
+    h ^= (uint64_t)ports * 0x9e3779b97f4a7c15ull;
+  }
+  // The MurmurHash3 finalizer.
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
 }
 
 void IP::setRouting(Routing *routing) {
@@ -92,19 +175,22 @@ int IP::sendWithHeader(void *packet, size_t packetLen, SendOptions options) {
     assert(csum16(&header, hdrLen) == 0);
 #endif
 
-    bool isBroadcast = false;
-    for (auto &&e : addrs)
-      if (!options.device || e.device == options.device) {
-        if (header.dst == BROADCAST || header.dst == (e.addr | ~e.mask)) {
-          isBroadcast = true;
-          int rc1 =
-              l2.send(packet, packetLen, L2::BROADCAST, PROTOCOL_ID, e.device);
+    if (header.dst == BROADCAST) {
+      // Once on each device with an address.
+      for (auto &&e : deviceAddrs)
+        if (!options.device || e.first == options.device) {
+          int rc1 = sendFrames(packet, packetLen, L2::BROADCAST, e.first);
           if (rc1 != 0)
             rc = rc1;
         }
-      }
-    if (isBroadcast)
       break;
+    }
+    L2::Device *broadcastDevice = findDeviceByBroadcast(header.dst);
+    if (broadcastDevice &&
+        (!options.device || broadcastDevice == options.device)) {
+      rc = sendFrames(packet, packetLen, L2::BROADCAST, broadcastDevice);
+      break;
+    }
 
     if (!routing) {
       LOG_ERR("No IP routing policy");
@@ -117,19 +203,20 @@ int IP::sendWithHeader(void *packet, size_t packetLen, SendOptions options) {
       hop.device = options.device;
       dstMAC = options.dstMAC;
     } else {
-      rc = routing->query(header.dst, hop);
+      if (options.hop)
+        hop = *options.hop;
+      else
+        rc = routing->query(header.dst, flowHash(packet, packetLen), hop);
       if (rc != 0) {
         LOG_ERR("IP routing error for " IP_ADDR_FMT_STRING,
                 IP_ADDR_FMT_ARGS(header.dst));
         break;
       }
       Addr hopAddr = hop.gateway == Addr{0} ? header.dst : hop.gateway;
-      rc = arp.query(hopAddr, dstMAC);
+      rc = arp.query(hopAddr, hop.device, dstMAC);
       if (rc == E_WAIT_FOR_TRYAGAIN) {
-        LOG_ERR("ARP query for " IP_ADDR_FMT_STRING ": wait to try again",
-                IP_ADDR_FMT_ARGS(hopAddr));
-
         if (options.autoRetry) {
+          // Wait in the queue of the neighbor.
           void *packetCopy;
           if (options.freeBuf)
             packetCopy = packet;
@@ -141,23 +228,16 @@ int IP::sendWithHeader(void *packet, size_t packetLen, SendOptions options) {
             }
             memcpy(packetCopy, packet, packetLen);
           }
-          options.autoRetry = false;
-          options.freeBuf = false;
-          arp.addWait(
-              hopAddr,
-              [this, packetCopy, packetLen, options](bool succ) {
-                if (succ)
-                  sendWithHeader(packetCopy, packetLen, options);
-                free(packetCopy);
-              },
-              options.retryTimeout);
+          arp.enqueue(hopAddr, packetCopy, packetLen, options.retryTimeout);
           return rc;
         }
+        LOG_ERR("ARP query for " IP_ADDR_FMT_STRING ": wait to try again",
+                IP_ADDR_FMT_ARGS(hopAddr));
       }
       if (rc != 0)
         break;
     }
-    rc = l2.send(packet, packetLen, dstMAC, PROTOCOL_ID, hop.device);
+    rc = sendFrames(packet, packetLen, dstMAC, hop.device);
 
   } while (0);
 
@@ -166,6 +246,69 @@ int IP::sendWithHeader(void *packet, size_t packetLen, SendOptions options) {
   return rc;
 }
 
+int IP::sendFrames(const void *packet, size_t packetLen, L2::Addr dstMAC,
+                   L2::Device *device) {
+  if (packetLen <= device->mtu)
+    return l2.send(packet, packetLen, dstMAC, PROTOCOL_ID, device);
+
+  const Header &header = *(const Header *)packet;
+  uint16_t flagsAndOffset = ntohs(header.flagsAndFragmentOffset);
+  if (flagsAndOffset & 0x4000) {
+    LOG_ERR("IP packet of %lu bytes to " IP_ADDR_FMT_STRING
+            " exceeds the MTU with DF set",
+            packetLen, IP_ADDR_FMT_ARGS(header.dst));
+    return -1;
+  }
+  size_t hdrLen = (header.versionAndIHL & 0x0f) * 4;
+  size_t offset = (flagsAndOffset & 0x1fff) * 8; // When refragmenting
+  bool more = flagsAndOffset & 0x2000;
+
+  size_t mtu = device->mtu;
+  Vector<char> fragBuf(mtu);
+  char *frag = fragBuf.data();
+  Header &fragHeader = *(Header *)frag;
+  memcpy(frag, packet, hdrLen);
+  size_t fragHdrLen = hdrLen;
+  const char *data = (const char *)packet + hdrLen;
+  size_t dataLen = packetLen - hdrLen;
+  int rc = 0;
+  for (size_t pos = 0; pos < dataLen;) {
+    size_t chunk = std::min((mtu - fragHdrLen) & ~(size_t)7, dataLen - pos);
+    bool last = pos + chunk == dataLen;
+    fragHeader.totalLength = htons(fragHdrLen + chunk);
+    fragHeader.flagsAndFragmentOffset =
+        htons((last && !more ? 0 : 0x2000) | (offset + pos) / 8);
+    fragHeader.headerChecksum = 0;
+    fragHeader.headerChecksum = csum16(frag, fragHdrLen);
+    memcpy(frag + fragHdrLen, data + pos, chunk);
+    if ((rc = l2.send(frag, fragHdrLen + chunk, dstMAC, PROTOCOL_ID,
+                      device)) != 0)
+      break;
+    pos += chunk;
+
+    if (fragHdrLen == hdrLen && hdrLen > sizeof(Header)) {
+      // Only options with the copied flag go on in the later fragments.
+      const unsigned char *opt = (const unsigned char *)packet + sizeof(Header);
+      const unsigned char *optEnd = (const unsigned char *)packet + hdrLen;
+      fragHdrLen = sizeof(Header);
+      while (opt < optEnd && *opt != 0) {
+        size_t optLen = *opt == 1 ? 1 : opt + 1 < optEnd ? opt[1] : 0;
+        if (optLen < 1 || opt + optLen > optEnd)
+          break;
+        if (*opt & 0x80) {
+          memcpy(frag + fragHdrLen, opt, optLen);
+          fragHdrLen += optLen;
+        }
+        opt += optLen;
+      }
+      while (fragHdrLen % 4 != 0)
+        frag[fragHdrLen++] = 0;
+      fragHeader.versionAndIHL = 4 << 4 | fragHdrLen / 4;
+    }
+  }
+  return rc;
+}
+
 int IP::send(const void *data, size_t dataLen, Addr src, Addr dst,
              uint8_t protocol, SendOptions options) {
   int rc;
@@ -191,8 +334,9 @@ int IP::send(const void *data, size_t dataLen, Addr src, Addr dst,
     header = Header{.versionAndIHL = 4 << 4 | 5,
                     .typeOfService = 0,
                     .totalLength = htons(packetLen),
-                    .identification = 0,
-                    .flagsAndFragmentOffset = htons(0b010 << 13 | 0),
+                    .identification = htons(nextId++),
+                    .flagsAndFragmentOffset =
+                        htons(options.dontFragment ? 0b010 << 13 : 0),
                     .timeToLive = options.timeToLive,
                     .protocol = protocol,
                     .headerChecksum = 0,
@@ -256,21 +400,20 @@ void IP::handleRecv(const void *packet, size_t packetCapLen,
     return;
   }
 
+  // Local unicast, broadcast, or to be forwarded (no end device).
   L2::Device *endDevice = nullptr;
   bool isBroadcast = false;
   if (header.dst == BROADCAST) {
     endDevice = info.device;
     isBroadcast = true;
   } else {
-    for (auto &&e : addrs)
-      if (header.dst == (e.addr | ~e.mask)) {
-        endDevice = e.device;
-        isBroadcast = true;
-        break;
-      }
+    auto it = localAddrs.find(header.dst);
+    if (it != localAddrs.end()) {
+      isBroadcast = it->second.broadcastDevice != nullptr;
+      endDevice =
+          isBroadcast ? it->second.broadcastDevice : it->second.device;
+    }
   }
-  if (!isBroadcast)
-    endDevice = findDeviceByAddr(header.dst);
   IP::RecvInfo newInfo{.l2 = info,
                        .header = &header,
                        .isBroadcast = isBroadcast,
@@ -285,15 +428,141 @@ void IP::handleRecv(const void *packet, size_t packetCapLen,
       it++;
   }
 
-  if (endDevice) {
-    auto r = onRecv.equal_range(header.protocol);
-    for (auto it = r.first; it != r.second;) {
-      if (it->second(data, dataLen, newInfo) == 1)
-        it = onRecv.erase(it);
-      else
-        it++;
+  if (!endDevice)
+    return;
+  if ((ntohs(header.flagsAndFragmentOffset) & 0x3fff) != 0)
+    handleFragment(data, dataLen, newInfo);
+  else
+    deliver(data, dataLen, newInfo);
+}
+
+void IP::deliver(const void *data, size_t dataLen, const RecvInfo &info) {
+  auto r = onRecv.equal_range(info.header->protocol);
+  for (auto it = r.first; it != r.second;) {
+    if (it->second(data, dataLen, info) == 1)
+      it = onRecv.erase(it);
+    else
+      it++;
+  }
+}
+
+void IP::handleFragment(const void *data, size_t dataLen,
+                        const RecvInfo &info) {
+  const Header &header = *info.header;
+  size_t hdrLen = (header.versionAndIHL & 0x0f) * 4;
+  uint16_t flagsAndOffset = ntohs(header.flagsAndFragmentOffset);
+  size_t begin = (flagsAndOffset & 0x1fff) * 8, end = begin + dataLen;
+  bool more = flagsAndOffset & 0x2000;
+  if ((more && (dataLen == 0 || dataLen % 8 != 0)) ||
+      end > UINT16_MAX - sizeof(Header)) {
+    LOG_INFO("Invalid IP fragment: %lu+%lu", begin, dataLen);
+    return;
+  }
+
+  FragKey key{.src = header.src,
+              .dst = header.dst,
+              .identification = header.identification,
+              .protocol = header.protocol,
+              .zero = 0};
+  auto it = reassemblies.find(key);
+  if (it == reassemblies.end()) {
+    it = reassemblies.insert({key, Reassembly{}}).first;
+    auto &&r = it->second;
+    r.timer = l2.netBase.timer.add(
+        [this, key]() {
+          auto it = reassemblies.find(key);
+          it->second.timer = nullptr;
+          LOG_INFO("IP reassembly timeout from " IP_ADDR_FMT_STRING,
+                   IP_ADDR_FMT_ARGS(key.src));
+          removeReassembly(it);
+        },
+        REASSEMBLY_TIMEOUT);
+    r.age = reassemblyAges.insert(reassemblyAges.end(), key);
+  }
+  auto &&r = it->second;
+
+  // Drop the datagram if inconsistent or too fragmented.
+  if (++r.nFragments > MAX_FRAGMENTS ||
+      (r.dataLen && (more ? end > r.dataLen : end != r.dataLen)) ||
+      (!more && !r.ranges.empty() && r.ranges.back().second > end)) {
+    LOG_INFO("Bad IP fragments from " IP_ADDR_FMT_STRING,
+             IP_ADDR_FMT_ARGS(key.src));
+    removeReassembly(it);
+    return;
+  }
+  if (!more)
+    r.dataLen = end;
+
+  if (end > r.dataCap) {
+    // Grow geometrically until the length is known.
+    size_t cap = r.dataLen ? r.dataLen : std::max(end, r.dataCap * 2);
+    cap = std::min(cap, UINT16_MAX - sizeof(Header));
+    // Evict the oldest datagrams to make room.
+    while (reassemblyMem + cap - r.dataCap > REASSEMBLY_MEM &&
+           !(reassemblyAges.front() == key)) {
+      LOG_INFO("IP reassembly memory exhausted");
+      removeReassembly(reassemblies.find(reassemblyAges.front()));
+    }
+    char *newData;
+    if (reassemblyMem + cap - r.dataCap > REASSEMBLY_MEM ||
+        !(newData = (char *)realloc(r.data, cap))) {
+      removeReassembly(it);
+      return;
     }
+    reassemblyMem += cap - r.dataCap;
+    r.data = newData;
+    r.dataCap = cap;
   }
+  memcpy(r.data + begin, data, dataLen);
+  if (begin == 0) {
+    memcpy(r.header, &header, hdrLen);
+    r.hdrLen = hdrLen;
+  }
+
+  // Merge into the received ranges.
+  auto pos = std::lower_bound(r.ranges.begin(), r.ranges.end(),
+                              std::make_pair(begin, end));
+  if (pos != r.ranges.begin() && std::prev(pos)->second >= begin)
+    pos--;
+  auto last = pos;
+  while (last != r.ranges.end() && last->first <= end) {
+    begin = std::min(begin, last->first);
+    end = std::max(end, last->second);
+    last++;
+  }
+  pos = r.ranges.erase(pos, last);
+  r.ranges.insert(pos, {begin, end});
+
+  if (r.dataLen && r.ranges.size() == 1 && r.ranges[0].first == 0 &&
+      r.ranges[0].second == r.dataLen) {
+    Header &newHeader = *(Header *)r.header;
+    newHeader.totalLength = htons(r.hdrLen + r.dataLen);
+    newHeader.flagsAndFragmentOffset = 0;
+    newHeader.headerChecksum = 0;
+    newHeader.headerChecksum = csum16(&newHeader, r.hdrLen);
+    // Take over the buffers before removing the entry.
+    char datagramHeader[sizeof(r.header)];
+    memcpy(datagramHeader, r.header, r.hdrLen);
+    char *datagram = r.data;
+    size_t datagramLen = r.dataLen;
+    r.data = nullptr;
+    removeReassembly(it);
+
+    RecvInfo newInfo = info;
+    newInfo.header = (const Header *)datagramHeader;
+    deliver(datagram, datagramLen, newInfo);
+    free(datagram);
+  }
+}
+
+void IP::removeReassembly(HashMap<FragKey, Reassembly>::iterator it) {
+  auto &&r = it->second;
+  if (r.timer)
+    l2.netBase.timer.remove(r.timer);
+  free(r.data);
+  reassemblyMem -= r.dataCap;
+  reassemblyAges.erase(r.age);
+  reassemblies.erase(it);
 }
 
 int IP::setup() {
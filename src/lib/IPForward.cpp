@@ -25,6 +25,8 @@ int IPForward::setup() {
         return 0;
       },
       0, true);
+  ip.l2.netBase.addOnBurstEnd([this]() { flush(); });
+  burst.reserve(MAX_BURST);
   return 0;
 }
 
@@ -70,5 +72,44 @@ void IPForward::handleRecv(const void *data, size_t dataLen,
   auto &newHeader = *(IP::Header *)newBuf;
   newHeader.timeToLive -= procTime;
 
-  ip.sendWithHeader(newBuf, packetLen, {.autoRetry = true, .freeBuf = true});
+  burst.push_back(
+      {newBuf, (size_t)packetLen, info.l2.device, info.l2.header->src});
+  if (burst.size() == MAX_BURST)
+    flush();
+}
+
+void IPForward::flush() {
+  size_t n = burst.size();
+  if (n == 0)
+    return;
+  IP::Routing *routing = ip.getRouting();
+  IP::Addr dsts[MAX_BURST];
+  uint32_t flowHashes[MAX_BURST];
+  IP::Routing::HopInfo hops[MAX_BURST];
+  if (routing) {
+    for (size_t i = 0; i < n; i++) {
+      dsts[i] = ((const IP::Header *)burst[i].packet)->dst;
+      flowHashes[i] = IP::flowHash(burst[i].packet, burst[i].packetLen);
+    }
+    routing->queryBatch(dsts, hops, n, flowHashes);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    // Unrouted ones are queried (and reported) again on sending.
+    const IP::Routing::HopInfo *hop =
+        routing && hops[i].device ? &hops[i] : nullptr;
+    const auto &header = *(const IP::Header *)burst[i].packet;
+    if (hop && burst[i].packetLen > hop->device->mtu &&
+        (ntohs(header.flagsAndFragmentOffset) & 0x4000)) {
+      // Too large with DF set: tell the source the MTU (RFC 1191).
+      ip.icmp.sendDestUnreachable(burst[i].packet, burst[i].packetLen, 4,
+                                  hop->device->mtu, burst[i].device,
+                                  burst[i].srcMAC);
+      free(burst[i].packet);
+      continue;
+    }
+    ip.sendWithHeader(burst[i].packet, burst[i].packetLen,
+                      {.autoRetry = true, .freeBuf = true, .hop = hop});
+  }
+  burst.clear();
 }
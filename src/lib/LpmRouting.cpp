@@ -1,22 +1,144 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "log.h"
 
 #include "LpmRouting.h"
 
+namespace {
+
+constexpr char IMAGE_MAGIC[8] = {'L', 'N', 'S', 'F', 'I', 'B', 0, 2};
+
+struct ImageHeader {
+  char magic[8];
+  uint32_t nDevices;
+  uint32_t nEntries;
+  uint32_t nNodes;
+  uint32_t zero;
+};
+
+struct ImageDevice {
+  char name[IF_NAMESIZE];
+};
+
+struct ImageEntry {
+  IP::Addr addr;
+  IP::Addr mask;
+  IP::Addr gateway;
+  uint32_t device; // Index in the device table.
+  int32_t next;    // Index of the next hop in the same prefix, -1 for none.
+};
+
+int prefixLen(IP::Addr mask) {
+  return __builtin_popcount(mask.num);
+}
+
+} // namespace
+
+LpmRouting::LpmRouting() : indexValid(true), image(nullptr), imageLen(0) {
+  clear();
+}
+
+LpmRouting::~LpmRouting() {
+  unmapImage();
+}
+
 int LpmRouting::query(const Addr &addr, HopInfo &res) {
-  int rc = -1;
-  Addr curMask = {0};
-  for (auto &&e : table)
-    if ((addr & e.mask) == e.addr && (e.mask & curMask) == curMask) {
-      res.device = e.device;
-      res.gateway = e.gateway;
-      curMask = e.mask;
-      rc = 0;
+  return query(addr, 0, res);
+}
+
+int LpmRouting::query(const Addr &addr, uint32_t flowHash, HopInfo &res) {
+  uint32_t key = ntohl(addr.num);
+  int32_t found = trie[0].entry;
+  uint32_t p = 0;
+  for (int i = 0; i < 32 && (p = trie[p].child[key >> (31 - i) & 1]); i++)
+    if (trie[p].entry >= 0)
+      found = trie[p].entry;
+  if (found < 0)
+    return -1;
+  found = pickPath(found, flowHash);
+  res.device = table[found].device;
+  res.gateway = table[found].gateway;
+  return 0;
+}
+
+size_t LpmRouting::queryBatch(const Addr *dsts, HopInfo *res, size_t n,
+                              const uint32_t *flowHashes) {
+  if (n == 1) {
+    if (query(dsts[0], flowHashes ? flowHashes[0] : 0, res[0]) == 0)
+      return 1;
+    res[0].device = nullptr;
+    return 0;
+  }
+
+  constexpr size_t LANES = 16;
+  size_t nFound = 0;
+  for (size_t base = 0; base < n; base += LANES) {
+    size_t m = std::min(LANES, n - base);
+    uint32_t key[LANES], p[LANES];
+    int32_t found[LANES];
+    for (size_t i = 0; i < m; i++) {
+      key[i] = ntohl(dsts[base + i].num);
+      p[i] = 0;
+      found[i] = -1;
     }
-  return rc;
+
+    // Walk all the lanes one level per round, prefetching the nodes for the
+    // next round instead of waiting for each load in turn.
+    uint32_t active = (1u << m) - 1;
+    for (int d = 0; active; d++) {
+      for (uint32_t a = active; a; a &= a - 1) {
+        int i = __builtin_ctz(a);
+        const Node &node = trie[p[i]];
+        if (node.entry >= 0)
+          found[i] = node.entry;
+        uint32_t c = d < 32 ? node.child[key[i] >> (31 - d) & 1] : 0;
+        if (!c) {
+          active &= ~(1u << i);
+          continue;
+        }
+        p[i] = c;
+        __builtin_prefetch(&trie[c]);
+      }
+    }
+
+    for (size_t i = 0; i < m; i++) {
+      HopInfo &r = res[base + i];
+      if (found[i] < 0) {
+        r.device = nullptr;
+        continue;
+      }
+      int32_t e = pickPath(found[i], flowHashes ? flowHashes[base + i] : 0);
+      r.device = table[e].device;
+      r.gateway = table[e].gateway;
+      nFound++;
+    }
+  }
+  return nFound;
 }
 
-int LpmRouting::setEntry(const Entry &entry) {
-  Addr newMask = {0};
+int32_t LpmRouting::pickPath(int32_t first, uint32_t flowHash) {
+  if (nextPath[first] < 0)
+    return first;
+  uint32_t n = 0;
+  for (int32_t p = first; p >= 0; p = nextPath[p])
+    n++;
+  for (n = flowHash % n; n > 0; n--)
+    first = nextPath[first];
+  return first;
+}
+
+int LpmRouting::checkEntry(const Entry &entry) {
   bool inPrefix = true;
 
   if ((entry.addr & entry.mask) != entry.addr) {
@@ -36,27 +158,372 @@ int LpmRouting::setEntry(const Entry &entry) {
     if (x != 0xFF)
       inPrefix = false;
   }
+  return 0;
+}
 
-  for (auto &e : table)
-    if (e.addr == entry.addr && e.mask == entry.mask) {
-      e = entry;
-      return 0;
+void LpmRouting::clear() {
+  unmapImage();
+  table.clear();
+  nextPath.clear();
+  index.clear();
+  indexValid = true;
+  nodes.assign(1, Node{.child = {0, 0}, .entry = -1});
+  trie = nodes.data();
+  freeNodes.clear();
+}
+
+void LpmRouting::unmapImage() {
+  if (image) {
+    munmap(image, imageLen);
+    image = nullptr;
+    imageLen = 0;
+  }
+}
+
+void LpmRouting::makeWritable() {
+  if (image) {
+    size_t nNodes = ((const ImageHeader *)image)->nNodes;
+    nodes.assign(trie, trie + nNodes);
+    trie = nodes.data();
+    unmapImage();
+  }
+  if (!indexValid) {
+    index.reserve(table.size());
+    for (size_t i = 0; i < table.size(); i++)
+      index[{table[i].addr, table[i].mask}] =
+          findNode(table[i].addr, table[i].mask);
+    indexValid = true;
+  }
+}
+
+int LpmRouting::findNode(Addr addr, Addr mask) {
+  uint32_t key = ntohl(addr.num);
+  uint32_t p = 0;
+  for (int i = 0, n = prefixLen(mask); i < n; i++)
+    if (!(p = trie[p].child[key >> (31 - i) & 1]))
+      return -1;
+  return p;
+}
+
+int LpmRouting::insertNode(Addr addr, Addr mask) {
+  uint32_t key = ntohl(addr.num);
+  uint32_t p = 0;
+  for (int i = 0, n = prefixLen(mask); i < n; i++) {
+    int b = key >> (31 - i) & 1;
+    if (!nodes[p].child[b]) {
+      uint32_t c;
+      if (freeNodes.empty()) {
+        c = nodes.size();
+        nodes.push_back(Node{.child = {0, 0}, .entry = -1});
+      } else {
+        c = freeNodes.back();
+        freeNodes.pop_back();
+        nodes[c] = Node{.child = {0, 0}, .entry = -1};
+      }
+      nodes[p].child[b] = c;
     }
+    p = nodes[p].child[b];
+  }
+  trie = nodes.data();
+  return p;
+}
+
+void LpmRouting::pruneNode(Addr addr, Addr mask) {
+  uint32_t key = ntohl(addr.num);
+  int n = prefixLen(mask);
+  uint32_t path[33] = {0};
+  for (int i = 0; i < n; i++)
+    path[i + 1] = nodes[path[i]].child[key >> (31 - i) & 1];
+  // Unlink the nodes left with neither an entry nor children, bottom up.
+  for (int i = n; i > 0; i--) {
+    const Node &node = nodes[path[i]];
+    if (node.entry >= 0 || node.child[0] || node.child[1])
+      break;
+    nodes[path[i - 1]].child[key >> (31 - (i - 1)) & 1] = 0;
+    freeNodes.push_back(path[i]);
+  }
+}
+
+int LpmRouting::putEntry(const Entry &entry, bool addPath) {
+  auto r = index.insert({{entry.addr, entry.mask}, 0});
+  if (r.second)
+    r.first->second = insertNode(entry.addr, entry.mask);
+  int32_t &head = nodes[r.first->second].entry;
+  if (head < 0) {
+    head = table.size();
+    table.push_back(entry);
+    nextPath.push_back(-1);
+    return 0;
+  }
+  if (!addPath) {
+    table[head] = entry;
+    while (nextPath[head] >= 0)
+      removeAt(nextPath[head]);
+    return 0;
+  }
 
+  int32_t p = head;
+  int n = 1;
+  for (;; p = nextPath[p], n++) {
+    if (table[p].device == entry.device && table[p].gateway == entry.gateway)
+      return 0;
+    if (nextPath[p] < 0)
+      break;
+  }
+  if (n >= MAX_PATHS)
+    return 1;
+  nextPath[p] = table.size();
   table.push_back(entry);
+  nextPath.push_back(-1);
   return 0;
 }
 
-int LpmRouting::delEntry(Addr addr, Addr mask) {
-  for (auto it = table.begin(); it != table.end(); it++) {
-    if (it->addr == addr && it->mask == mask) {
-      table.erase(it);
-      return 0;
-    }
+int32_t *LpmRouting::findLink(size_t i) {
+  int32_t *link = &nodes[index[{table[i].addr, table[i].mask}]].entry;
+  while (*link != (int32_t)i)
+    link = &nextPath[*link];
+  return link;
+}
+
+void LpmRouting::removeAt(size_t i) {
+  *findLink(i) = nextPath[i];
+
+  // Keep `table` dense by moving the last entry into the hole.
+  size_t last = table.size() - 1;
+  if (i != last) {
+    *findLink(last) = i;
+    table[i] = table[last];
+    nextPath[i] = nextPath[last];
   }
-  return 1;
+  table.pop_back();
+  nextPath.pop_back();
+}
+
+int LpmRouting::setEntry(const Entry &entry) {
+  if (checkEntry(entry) != 0)
+    return 1;
+  makeWritable();
+  return putEntry(entry, false);
+}
+
+int LpmRouting::addPath(const Entry &entry) {
+  if (checkEntry(entry) != 0)
+    return 1;
+  makeWritable();
+  return putEntry(entry, true);
+}
+
+int LpmRouting::delEntry(Addr addr, Addr mask) {
+  makeWritable();
+  auto it = index.find({addr, mask});
+  if (it == index.end())
+    return 1;
+  int32_t &head = nodes[it->second].entry;
+  while (head >= 0)
+    removeAt(head);
+  index.erase(it);
+  pruneNode(addr, mask);
+  return 0;
 }
 
 const Vector<LpmRouting::Entry> &LpmRouting::getTable() {
   return table;
 }
+
+int LpmRouting::build(const Vector<Entry> &entries) {
+  clear();
+  table.reserve(entries.size());
+  nextPath.reserve(entries.size());
+  index.reserve(entries.size());
+  for (auto &&e : entries) {
+    if (checkEntry(e) != 0) {
+      clear();
+      return 1;
+    }
+    putEntry(e, false);
+  }
+  return 0;
+}
+
+int LpmRouting::loadFile(const char *path, L2 &l2) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    LOG_ERR_POSIX("fopen(%s)", path);
+    return -1;
+  }
+
+  Vector<Entry> entries;
+  char line[256], devName[IF_NAMESIZE];
+  int lineNo = 0, rc = 0;
+  L2::Device *lastDevice = nullptr;
+  while (fgets(line, sizeof(line), fp)) {
+    lineNo++;
+    char *p = line + strspn(line, " \t");
+    if (*p == '#' || *p == '\n' || *p == '\0')
+      continue;
+
+    Entry e;
+    if (sscanf(p,
+               IP_ADDR_FMT_STRING " " IP_ADDR_FMT_STRING
+                                  " %15s " IP_ADDR_FMT_STRING,
+               IP_ADDR_FMT_ARGS(&e.addr), IP_ADDR_FMT_ARGS(&e.mask), devName,
+               IP_ADDR_FMT_ARGS(&e.gateway)) != 3 * IP_ADDR_FMT_NUM + 1) {
+      LOG_ERR("%s:%d: invalid route", path, lineNo);
+      rc = -1;
+      break;
+    }
+    if (lastDevice && strcmp(lastDevice->name, devName) == 0) {
+      e.device = lastDevice;
+    } else if (!(e.device = lastDevice = l2.findDeviceByName(devName))) {
+      LOG_ERR("%s:%d: no such device: %s", path, lineNo, devName);
+      rc = -1;
+      break;
+    }
+    entries.push_back(e);
+  }
+  fclose(fp);
+
+  if (rc == 0 && build(entries) != 0)
+    rc = -1;
+  return rc;
+}
+
+int LpmRouting::saveImage(const char *path) {
+  Vector<ImageDevice> devices;
+  HashMap<L2::Device *, uint32_t> devIndex;
+  Vector<ImageEntry> entries;
+  entries.reserve(table.size());
+  for (size_t i = 0; i < table.size(); i++) {
+    const Entry &e = table[i];
+    auto r = devIndex.insert({e.device, devices.size()});
+    if (r.second) {
+      ImageDevice d{};
+      strncpy(d.name, e.device->name, IF_NAMESIZE - 1);
+      devices.push_back(d);
+    }
+    entries.push_back({.addr = e.addr,
+                       .mask = e.mask,
+                       .gateway = e.gateway,
+                       .device = r.first->second,
+                       .next = nextPath[i]});
+  }
+
+  size_t nNodes = image ? ((const ImageHeader *)image)->nNodes : nodes.size();
+  ImageHeader header{.nDevices = (uint32_t)devices.size(),
+                     .nEntries = (uint32_t)entries.size(),
+                     .nNodes = (uint32_t)nNodes,
+                     .zero = 0};
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+
+  // Write to a temporary file first, so that readers never map a partial one.
+  char tmpPath[PATH_MAX];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  FILE *fp = fopen(tmpPath, "wb");
+  if (!fp) {
+    LOG_ERR_POSIX("fopen(%s)", tmpPath);
+    return -1;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+            fwrite(devices.data(), sizeof(ImageDevice), devices.size(), fp) ==
+                devices.size() &&
+            fwrite(entries.data(), sizeof(ImageEntry), entries.size(), fp) ==
+                entries.size() &&
+            fwrite(trie, sizeof(Node), nNodes, fp) == nNodes;
+  if (fclose(fp) != 0)
+    ok = false;
+  if (!ok || rename(tmpPath, path) != 0) {
+    LOG_ERR_POSIX("write image %s", path);
+    unlink(tmpPath);
+    return -1;
+  }
+  return 0;
+}
+
+int LpmRouting::loadImage(const char *path, L2 &l2) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    LOG_ERR_POSIX("open(%s)", path);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    LOG_ERR_POSIX("fstat(%s)", path);
+    close(fd);
+    return -1;
+  }
+  size_t len = st.st_size;
+  void *p = len >= sizeof(ImageHeader)
+                ? mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0)
+                : MAP_FAILED;
+  close(fd);
+  if (p == MAP_FAILED) {
+    LOG_ERR("Unable to map image %s", path);
+    return -1;
+  }
+
+  const ImageHeader &header = *(const ImageHeader *)p;
+  auto *devices = (const ImageDevice *)(&header + 1);
+  auto *entries = (const ImageEntry *)(devices + header.nDevices);
+  auto *imageNodes = (const Node *)(entries + header.nEntries);
+  if (memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 ||
+      header.nNodes == 0 ||
+      len != sizeof(ImageHeader) + sizeof(ImageDevice) * header.nDevices +
+                 sizeof(ImageEntry) * header.nEntries +
+                 sizeof(Node) * header.nNodes) {
+    LOG_ERR("Invalid image %s", path);
+    munmap(p, len);
+    return -1;
+  }
+  bool valid = true;
+  for (uint32_t i = 0; i < header.nEntries && valid; i++)
+    valid = entries[i].device < header.nDevices && entries[i].next >= -1 &&
+            entries[i].next < (int64_t)header.nEntries;
+  // Every entry must be in exactly one next-hop list of a node.
+  Vector<bool> seen(header.nEntries);
+  size_t nSeen = 0;
+  for (uint32_t i = 0; i < header.nNodes && valid; i++) {
+    const Node &n = imageNodes[i];
+    valid = n.child[0] < header.nNodes && n.child[1] < header.nNodes &&
+            n.entry < (int64_t)header.nEntries;
+    int k = 0;
+    for (int32_t e = n.entry; e >= 0 && valid; e = entries[e].next, k++) {
+      valid = k < MAX_PATHS && !seen[e];
+      seen[e] = true;
+      nSeen++;
+    }
+  }
+  if (!valid || nSeen != header.nEntries) {
+    LOG_ERR("Invalid image %s", path);
+    munmap(p, len);
+    return -1;
+  }
+
+  Vector<L2::Device *> devs(header.nDevices);
+  for (uint32_t i = 0; i < header.nDevices; i++) {
+    char name[IF_NAMESIZE + 1] = {};
+    memcpy(name, devices[i].name, IF_NAMESIZE);
+    if (!(devs[i] = l2.findDeviceByName(name))) {
+      LOG_ERR("Image %s: no such device: %s", path, name);
+      munmap(p, len);
+      return -1;
+    }
+  }
+
+  clear();
+  table.resize(header.nEntries);
+  nextPath.resize(header.nEntries);
+  for (uint32_t i = 0; i < header.nEntries; i++) {
+    const ImageEntry &e = entries[i];
+    table[i] = {.addr = e.addr,
+                .mask = e.mask,
+                .device = devs[e.device],
+                .gateway = e.gateway};
+    nextPath[i] = e.next;
+  }
+  image = p;
+  imageLen = len;
+  trie = imageNodes;
+  // The index is rebuilt lazily on the first modification.
+  indexValid = false;
+  return 0;
+}
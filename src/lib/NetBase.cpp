@@ -47,6 +47,10 @@ void NetBase::addOnRecv(RecvHandler handler, int linkType) {
   onRecv.insert({linkType, handler});
 }
 
+void NetBase::addOnBurstEnd(BurstEndHandler handler) {
+  onBurstEnd.push_back(handler);
+}
+
 void NetBase::handleRecv(const void *buf, size_t len, const RecvInfo &info) {
   auto r = onRecv.equal_range(info.device->linkType);
   for (auto it = r.first; it != r.second;) {
@@ -85,6 +89,7 @@ static void handlePcap(u_char *user, const pcap_pkthdr *h,
 
 int NetBase::loop() {
   while (1) {
+    int nFrames = 0;
     for (auto *d : devices) {
       PcapHandleArgs args{netBase : this, device : d};
       int rc = pcap_dispatch(d->p, -1, handlePcap, (u_char *)&args);
@@ -93,7 +98,11 @@ int NetBase::loop() {
           LOG_ERR_PCAP(d->p, "pcap_dispatch(%s)", d->name);
         return rc;
       }
+      nFrames += rc;
     }
+    if (nFrames > 0)
+      for (auto &&handler : onBurstEnd)
+        handler();
 
     dispatcher.handle();
     timer.handle();
@@ -1,7 +1,51 @@
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+
+#include <net/if.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ARP.h"
+#include "LpmRouting.h"
 #include "NetStackFull.h"
 
 #include "log.h"
 
+namespace {
+
+constexpr char SNAPSHOT_MAGIC[8] = {'L', 'N', 'S', 'W', 'A', 'R', 'M', 1};
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t nDevices;
+  uint32_t nNeighbors;
+  uint32_t nRoutes;
+  uint32_t zero;
+};
+
+struct SnapshotDevice {
+  char name[IF_NAMESIZE];
+};
+
+struct SnapshotNeighbor {
+  IP::Addr addr;
+  Ethernet::Addr linkAddr;
+  uint16_t device; // Index in the device table.
+} __attribute__((packed));
+
+struct SnapshotRoute {
+  IP::Addr addr;
+  IP::Addr mask;
+  IP::Addr gateway;
+  uint16_t device; // Index in the device table.
+  uint8_t metric;  // RIP metric, 0 for a static route.
+  uint8_t learned; // Learned by RIP (to be refreshed), otherwise permanent.
+} __attribute__((packed));
+
+} // namespace
+
 NetStackFull::NetStackFull() : udp(ip), tcp(ip), ipForward(nullptr), rip(nullptr) {
   if (udp.setup() != 0 || tcp.setup() != 0) {
     LOG_ERR("Netstack initialize failed");
@@ -9,6 +53,17 @@ NetStackFull::NetStackFull() : udp(ip), tcp(ip), ipForward(nullptr), rip(nullptr
   }
 }
 
+NetStackFull::~NetStackFull() {
+  if (snapshotPath.empty())
+    return;
+  // Save in the thread of looping if running (still needed by the services
+  // destructed later).
+  if (isRunning())
+    invoke([this]() { saveSnapshot(snapshotPath.c_str()); });
+  else
+    saveSnapshot(snapshotPath.c_str());
+}
+
 int NetStackFull::enableForward() {
   if (ipForward) {
     LOG_ERR("IP Forwarding already enabled.");
@@ -33,3 +88,171 @@ int NetStackFull::configRIP(Timer::Duration updateCycle,
   ip.setRouting(rip);
   return 0;
 }
+
+int NetStackFull::saveSnapshot(const char *path) {
+  Vector<SnapshotDevice> devices;
+  HashMap<Ethernet::Device *, uint16_t> devIndex;
+  auto indexOf = [&](Ethernet::Device *device) {
+    auto r = devIndex.insert({device, devices.size()});
+    if (r.second) {
+      SnapshotDevice d{};
+      strncpy(d.name, device->name, IF_NAMESIZE - 1);
+      devices.push_back(d);
+    }
+    return r.first->second;
+  };
+
+  Vector<SnapshotNeighbor> neighbors;
+  for (auto &&e : ip.arp.getTable())
+    if (e.second.state != ARP::State::INCOMPLETE)
+      neighbors.push_back({.addr = e.first,
+                           .linkAddr = e.second.linkAddr,
+                           .device = indexOf(e.second.device)});
+
+  // Local routes are rebuilt from the addresses.
+  auto isLocal = [&](IP::Addr addr, IP::Addr mask, Ethernet::Device *device) {
+    for (auto &&a : ip.getAddrs())
+      if (a.device == device && a.mask == mask && (a.addr & a.mask) == addr)
+        return true;
+    return false;
+  };
+  Vector<SnapshotRoute> routes;
+  if (rip) {
+    for (auto &&e : rip->getTable())
+      if (e.second.metric != 0 && e.second.metric < RIP::METRIC_INF)
+        routes.push_back(
+            {.addr = e.first.addr,
+             .mask = e.first.mask,
+             .gateway = e.second.gateway,
+             .device = indexOf(e.second.device),
+             .metric = (uint8_t)e.second.metric,
+             .learned = e.second.refreshTime != Timer::TimePoint()});
+  } else if (auto *r = dynamic_cast<LpmRouting *>(routing)) {
+    for (auto &&e : r->getTable())
+      if (e.gateway != IP::Addr{0} || !isLocal(e.addr, e.mask, e.device))
+        routes.push_back({.addr = e.addr,
+                          .mask = e.mask,
+                          .gateway = e.gateway,
+                          .device = indexOf(e.device),
+                          .metric = 0,
+                          .learned = 0});
+  }
+
+  SnapshotHeader header{.nDevices = (uint32_t)devices.size(),
+                        .nNeighbors = (uint32_t)neighbors.size(),
+                        .nRoutes = (uint32_t)routes.size(),
+                        .zero = 0};
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+
+  // Write to a temporary file first, so that a crash never leaves a partial
+  // snapshot.
+  char tmpPath[PATH_MAX];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  FILE *fp = fopen(tmpPath, "wb");
+  if (!fp) {
+    LOG_ERR_POSIX("fopen(%s)", tmpPath);
+    return -1;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+            fwrite(devices.data(), sizeof(SnapshotDevice), devices.size(),
+                   fp) == devices.size() &&
+            fwrite(neighbors.data(), sizeof(SnapshotNeighbor),
+                   neighbors.size(), fp) == neighbors.size() &&
+            fwrite(routes.data(), sizeof(SnapshotRoute), routes.size(), fp) ==
+                routes.size();
+  if (fclose(fp) != 0)
+    ok = false;
+  if (!ok || rename(tmpPath, path) != 0) {
+    LOG_ERR_POSIX("write snapshot %s", path);
+    unlink(tmpPath);
+    return -1;
+  }
+  return 0;
+}
+
+int NetStackFull::loadSnapshot(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    LOG_ERR_POSIX("fopen(%s)", path);
+    return -1;
+  }
+  struct stat st;
+  SnapshotHeader header;
+  Vector<SnapshotDevice> devices;
+  Vector<SnapshotNeighbor> neighbors;
+  Vector<SnapshotRoute> routes;
+  bool ok = fstat(fileno(fp), &st) == 0 &&
+            fread(&header, sizeof(header), 1, fp) == 1 &&
+            memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0;
+  // The counts must match the file size before anything is allocated by
+  // them.
+  ok = ok && (uint64_t)st.st_size ==
+                 sizeof(SnapshotHeader) +
+                     (uint64_t)sizeof(SnapshotDevice) * header.nDevices +
+                     (uint64_t)sizeof(SnapshotNeighbor) * header.nNeighbors +
+                     (uint64_t)sizeof(SnapshotRoute) * header.nRoutes;
+  if (ok) {
+    devices.resize(header.nDevices);
+    neighbors.resize(header.nNeighbors);
+    routes.resize(header.nRoutes);
+    ok = fread(devices.data(), sizeof(SnapshotDevice), devices.size(), fp) ==
+             devices.size() &&
+         fread(neighbors.data(), sizeof(SnapshotNeighbor), neighbors.size(),
+               fp) == neighbors.size() &&
+         fread(routes.data(), sizeof(SnapshotRoute), routes.size(), fp) ==
+             routes.size();
+  }
+  fclose(fp);
+  if (!ok) {
+    LOG_ERR("Invalid snapshot %s", path);
+    return -1;
+  }
+
+  // Devices no longer there are skipped with their entries.
+  Vector<Ethernet::Device *> devs(devices.size());
+  for (size_t i = 0; i < devices.size(); i++) {
+    char name[IF_NAMESIZE + 1] = {};
+    memcpy(name, devices[i].name, IF_NAMESIZE);
+    devs[i] = ethernet.findDeviceByName(name);
+  }
+  auto deviceOf = [&](uint16_t i) {
+    return i < devs.size() ? devs[i] : nullptr;
+  };
+
+  for (auto &&e : neighbors)
+    if (auto *device = deviceOf(e.device))
+      ip.arp.addStale(e.addr, e.linkAddr, device);
+
+  auto now = Timer::Clock::now();
+  auto *lpm = dynamic_cast<LpmRouting *>(routing);
+  HashSet<uint64_t> restored; // Prefixes set so far, as (address, mask).
+  for (auto &&e : routes) {
+    auto *device = deviceOf(e.device);
+    if (!device)
+      continue;
+    if (rip && e.metric != 0) {
+      rip->setEntry(e.addr, e.mask,
+                    {.device = device,
+                     .gateway = e.gateway,
+                     .metric = std::min<int>(e.metric, RIP::METRIC_INF),
+                     .refreshTime = e.learned ? now : Timer::TimePoint()});
+    } else if (!rip && lpm && e.metric == 0) {
+      LpmRouting::Entry entry{.addr = e.addr,
+                              .mask = e.mask,
+                              .device = device,
+                              .gateway = e.gateway};
+      // Equal-cost paths of a prefix are added to its first one.
+      if (restored.insert((uint64_t)e.addr.num << 32 | e.mask.num).second)
+        lpm->setEntry(entry);
+      else
+        lpm->addPath(entry);
+    }
+  }
+  return 0;
+}
+
+void NetStackFull::enableSnapshot(const char *path) {
+  snapshotPath = path;
+  if (access(path, F_OK) == 0 && loadSnapshot(path) == 0)
+    LOG_INFO("Warm-started from snapshot %s", path);
+}
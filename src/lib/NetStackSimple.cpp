@@ -116,6 +116,10 @@ void NetStackSimple::wait() {
   }
 }
 
+bool NetStackSimple::isRunning() {
+  return netThread != nullptr;
+}
+
 void NetStackSimple::invoke(Task task) {
   netBase.dispatcher.invoke(task);
 }
@@ -3,6 +3,8 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <algorithm>
+
 #include <arpa/inet.h>
 
 #include "log.h"
@@ -11,13 +13,19 @@
 constexpr int RIP::UDP_PORT = 520;
 constexpr int RIP::ADDRESS_FAMILY = 2;
 constexpr int RIP::METRIC_INF = 16;
+constexpr int RIP::MAX_ENTRIES =
+    (UINT16_MAX - sizeof(IP::Header) - sizeof(UDP::Header) -
+     sizeof(RIP::Header)) /
+    sizeof(RIP::DataEntry);
 
 RIP::RIP(UDP &udp_, NetworkLayer &network_, NetBase &netBase_,
          Timer::Duration updateCycle_, Timer::Duration expireCycle_,
          Timer::Duration cleanCycle_)
     : udp(udp_), network(network_), netBase(netBase_),
       updateCycle(updateCycle_), expireCycle(expireCycle_),
-      cleanCycle(cleanCycle_), matchTable(), updateTask(nullptr) {}
+      cleanCycle(cleanCycle_), holdDownCycle(updateCycle_), matchTable(),
+      updateTask(nullptr), triggerTask(nullptr), sweepTask(nullptr),
+      rnd(Timer::Clock::now().time_since_epoch().count()) {}
 
 int RIP::setup() {
   udp.addOnRecv(
@@ -28,6 +36,7 @@ int RIP::setup() {
       UDP_PORT);
   updateTask =
       netBase.timer.add([this]() { handleUpdateTimer(); }, updateCycle);
+  handleSweepTimer();
   sendRequest();
   sendUpdate();
   return 0;
@@ -46,7 +55,9 @@ int RIP::setEntry(const Addr &addr, const Addr &mask, const TabEntry &entry) {
   });
   if (rc != 0)
     return rc;
-  table[{addr, mask}] = entry;
+  auto &&r = table[{addr, mask}];
+  r = entry;
+  r.changed = true;
   return 0;
 }
 
@@ -54,6 +65,15 @@ int RIP::query(const Addr &addr, HopInfo &res) {
   return matchTable.query(addr, res);
 }
 
+int RIP::query(const Addr &addr, uint32_t flowHash, HopInfo &res) {
+  return matchTable.query(addr, flowHash, res);
+}
+
+size_t RIP::queryBatch(const Addr *dsts, HopInfo *res, size_t n,
+                       const uint32_t *flowHashes) {
+  return matchTable.queryBatch(dsts, res, n, flowHashes);
+}
+
 int RIP::sendRequest() {
   UDP::L3::Addr srcAddr;
   if (udp.l3.getAnyAddr(nullptr, srcAddr) < 0) {
@@ -67,67 +87,215 @@ int RIP::sendRequest() {
                          NetworkLayer::BROADCAST, UDP_PORT);
 }
 
-int RIP::sendUpdate() {
-  time_t curTime = time(nullptr);
-
-  UDP::L3::Addr srcAddr;
-  if (udp.l3.getAnyAddr(nullptr, srcAddr) < 0) {
-    ERRLOG("No IP address on the host.\n");
-    return -1;
-  }
-
-  const auto &netAddrs = network.getAddrs();
-  for (auto &&e : netAddrs) {
-    auto it = table.find({e.addr & e.mask, e.mask});
-    if (it != table.end() && it->second.expire) {
-      netBase.timer.remove(it->second.expire);
-    }
-    table[{e.addr & e.mask, e.mask}] = {
-        .device = e.device, .gateway = {0}, .metric = 0, .expire = nullptr};
+void RIP::updateLocal() {
+  for (auto &&e : network.getAddrs()) {
+    auto r = table.insert({{e.addr & e.mask, e.mask}, {}});
+    auto &&t = r.first->second;
+    if (!r.second && t.metric == 0 && t.device == e.device)
+      continue;
+    t = {.device = e.device,
+         .gateway = {0},
+         .metric = 0,
+         .refreshTime = {},
+         .changed = true};
     matchTable.setEntry({
       addr : e.addr & e.mask,
       mask : e.mask,
       device : e.device,
       gateway : {0}
     });
+    fibChanged();
   }
+}
 
-  int dataLen = sizeof(Header) + sizeof(DataEntry) * (int)table.size();
-  void *buf = malloc(dataLen);
-  if (!buf) {
-    ERRLOG("malloc error: %s\n", strerror(errno));
+int RIP::sendEntries(bool changedOnly) {
+  // One update per device, from its own (first) address.
+  Vector<const NetworkLayer::DevAddr *> ports;
+  for (auto &&d : network.getDeviceAddrs())
+    ports.push_back(&d.second.front());
+  if (ports.empty()) {
+    ERRLOG("No IP address on the host.\n");
     return -1;
   }
 
+  char buf[sizeof(Header) + sizeof(DataEntry) * MAX_ENTRIES];
   Header &header = *(Header *)buf;
   header = {command : 2, version : 0, zero : 0};
   DataEntry *p = (DataEntry *)(&header + 1);
-  for (auto &&e : table) {
-    *p++ = DataEntry{
-      addressFamily : htons(ADDRESS_FAMILY),
-      zero0 : 0,
-      address : e.first.addr,
-      mask : e.first.mask,
-      zero2 : 0,
-      metric : htonl(e.second.metric)
+
+  int rc = 0;
+  for (auto *port : ports) {
+    // As many as fit the MTU of the device, not to be fragmented.
+    int maxEntries = std::min<int>(
+        MAX_ENTRIES, (port->device->mtu - sizeof(IP::Header) -
+                      sizeof(UDP::Header) - sizeof(Header)) /
+                         sizeof(DataEntry));
+    int nEntries = 0, nSent = 0;
+    auto flush = [&]() {
+      int rc1 = udp.sendSegment(
+          buf, sizeof(Header) + sizeof(DataEntry) * nEntries, port->addr,
+          UDP_PORT, NetworkLayer::BROADCAST, UDP_PORT, port->device);
+      if (rc1 != 0)
+        rc = rc1;
+      nEntries = 0;
+      nSent++;
     };
+
+    for (auto &&e : table) {
+      if (changedOnly && !e.second.changed)
+        continue;
+      // Split horizon with poisoned reverse: routes learned through this
+      // device are advertised back as unreachable.
+      bool viaPort = e.second.device == port->device;
+      for (auto &&p : e.second.altPaths)
+        viaPort |= p.device == port->device;
+      int metric =
+          e.second.metric != 0 && viaPort ? METRIC_INF : e.second.metric;
+      p[nEntries++] = DataEntry{
+        addressFamily : htons(ADDRESS_FAMILY),
+        zero0 : 0,
+        address : e.first.addr,
+        mask : e.first.mask,
+        zero2 : 0,
+        metric : htonl(metric)
+      };
+      if (nEntries == maxEntries)
+        flush();
+    }
+    if (nEntries || (!changedOnly && !nSent))
+      flush();
   }
 
-  int rc = udp.sendSegment(buf, dataLen, srcAddr, UDP_PORT,
-                           NetworkLayer::BROADCAST, UDP_PORT);
-  free(buf);
+  for (auto &&e : table)
+    e.second.changed = false;
   return rc;
 }
 
+int RIP::sendUpdate() {
+  updateLocal();
+  return sendEntries(false);
+}
+
+int RIP::sendTriggeredUpdate() {
+  return sendEntries(true);
+}
+
+void RIP::triggerUpdate() {
+  if (triggerTask)
+    return;
+  auto now = Timer::Clock::now();
+  triggerTask = netBase.timer.add(
+      [this]() {
+        triggerTask = nullptr;
+        sendTriggeredUpdate();
+        // Wait for a random 1/30 ~ 1/6 update cycle (1 ~ 5s by default).
+        auto gap = updateCycle / 30;
+        nextTrigger = Timer::Clock::now() + gap + gap * (rnd() % 1024) / 256;
+      },
+      nextTrigger > now ? nextTrigger - now : Timer::Duration(0));
+}
+
+Timer::Duration RIP::getConvergenceTime() {
+  if (downTime == Timer::TimePoint() || fibChangeTime < downTime)
+    return Timer::Duration(0);
+  return fibChangeTime - downTime;
+}
+
+void RIP::installPaths(const Key &key, const TabEntry &entry) {
+  matchTable.setEntry({
+    addr : key.addr,
+    mask : key.mask,
+    device : entry.device,
+    gateway : entry.gateway
+  });
+  for (auto &&p : entry.altPaths)
+    matchTable.addPath({
+      addr : key.addr,
+      mask : key.mask,
+      device : p.device,
+      gateway : p.gateway
+    });
+  fibChanged();
+}
+
+bool RIP::updateAltPath(const Key &key, TabEntry &entry, Addr gateway,
+                        LinkLayer::Device *device, int metric) {
+  auto it = std::find_if(entry.altPaths.begin(), entry.altPaths.end(),
+                         [&](const Path &p) { return p.gateway == gateway; });
+  if (metric == entry.metric) {
+    if (it != entry.altPaths.end()) {
+      it->refreshTime = Timer::Clock::now();
+    } else if (entry.altPaths.size() + 1 < LpmRouting::MAX_PATHS) {
+      entry.altPaths.push_back({device, gateway, Timer::Clock::now()});
+      matchTable.addPath({
+        addr : key.addr,
+        mask : key.mask,
+        device : device,
+        gateway : gateway
+      });
+      fibChanged();
+    }
+    return true;
+  }
+  if (metric > entry.metric) {
+    if (it != entry.altPaths.end()) {
+      entry.altPaths.erase(it);
+      installPaths(key, entry);
+    }
+    return true;
+  }
+  // A better route, replacing all the paths.
+  return false;
+}
+
+void RIP::promoteAltPath(const Key &key, TabEntry &entry) {
+  // The metric is unchanged, so nothing to advertise.
+  const Path &p = entry.altPaths.back();
+  entry.device = p.device;
+  entry.gateway = p.gateway;
+  entry.refreshTime = p.refreshTime;
+  entry.altPaths.pop_back();
+  installPaths(key, entry);
+}
+
+void RIP::fibChanged() {
+  fibChangeTime = Timer::Clock::now();
+}
+
+void RIP::routeDown(TabEntry &entry) {
+  auto now = Timer::Clock::now();
+  entry.holdDown = now + holdDownCycle;
+  // A new failure episode, if the last one has settled for an update cycle.
+  if (downTime == Timer::TimePoint() || now - fibChangeTime > updateCycle)
+    downTime = now;
+}
+
 const RIP::Table &RIP::getTable() {
   return table;
 }
 
+Timer::TimePoint RIP::getExpireTime(const TabEntry &entry) {
+  if (entry.refreshTime == Timer::TimePoint())
+    return Timer::TimePoint::max();
+  return entry.refreshTime +
+         (entry.metric < METRIC_INF ? expireCycle : cleanCycle);
+}
+
+Timer::TimePoint RIP::getExpireTime(const Path &path) {
+  return path.refreshTime + expireCycle;
+}
+
 void RIP::setCycles(Timer::Duration updateCycle_, Timer::Duration expireCycle_,
                     Timer::Duration cleanCycle_) {
   updateCycle = updateCycle_;
   expireCycle = expireCycle_;
   cleanCycle = cleanCycle_;
+  holdDownCycle = updateCycle_;
+  if (sweepTask) {
+    netBase.timer.remove(sweepTask);
+    sweepTask = netBase.timer.add([this]() { handleSweepTimer(); },
+                                  std::min(expireCycle, cleanCycle) / 16);
+  }
   if (updateTask) {
     netBase.timer.remove(updateTask);
     updateTask =
@@ -160,83 +328,133 @@ void RIP::handleRecv(const void *msg, size_t msgLen,
 
   bool realUpdated = false;
 
-  time_t curTime = time(nullptr);
+  auto now = Timer::Clock::now();
   for (int i = 0; i < nEntries; i++) {
     const auto &e = ents[i];
     if (ntohs(e.addressFamily) != ADDRESS_FAMILY)
       continue;
 
-    int metric = ntohl(e.metric) + 1;
-    if (metric > METRIC_INF)
+    uint32_t advMetric = ntohl(e.metric);
+    if (advMetric > METRIC_INF)
       continue;
+    // Unreachable (poisoned) routes are accepted as unreachable.
+    int metric = std::min((int)advMetric + 1, METRIC_INF);
 
     // Ignore the local host.
     if (network.findDeviceByAddr(e.address))
       continue;
 
-    bool updateEnt = false;
-    if (!table.count({e.address, e.mask})) {
-      updateEnt = true;
-      realUpdated = true;
-    } else {
-      auto &&r = table[{e.address, e.mask}];
-      if ((r.metric != 0 && r.gateway == info.l3.header->src) ||
-          metric < r.metric) {
-        updateEnt = true;
-        if (metric != r.metric)
-          realUpdated = true;
+    auto r = table.insert({{e.address, e.mask}, {}});
+    auto it = r.first;
+    auto &&t = it->second;
+    Addr gateway = info.l3.header->src;
+    if (r.second && metric == METRIC_INF) {
+      table.erase(it);
+      continue;
+    }
+    // Equal-cost alternatives of a learned route.
+    if (!r.second && t.refreshTime != Timer::TimePoint() &&
+        t.metric < METRIC_INF) {
+      if (gateway != t.gateway &&
+          updateAltPath(it->first, t, gateway, info.l2.device, metric))
+        continue;
+      if (gateway == t.gateway && metric > t.metric && !t.altPaths.empty()) {
+        promoteAltPath(it->first, t);
+        continue;
       }
     }
+    if (!r.second) {
+      if (!((t.metric != 0 && t.gateway == gateway) || metric < t.metric))
+        continue;
+      // During hold-down, only the original gateway can bring it back.
+      if (t.metric == METRIC_INF && gateway != t.gateway && now < t.holdDown)
+        continue;
+    }
 
-    if (updateEnt) {
-      auto it = table.find({e.address, e.mask});
-      if (it != table.end()) {
-        if (it->second.expire)
-          netBase.timer.remove(it->second.expire);
-      } else {
-        it = table.insert({{e.address, e.mask}, {}}).first;
-      }
-      it->second = TabEntry{
-          .device = info.l2.device,
-          .gateway = info.l3.header->src,
-          .metric = metric,
-          .expire =
-              metric < METRIC_INF
-                  ? netBase.timer.add([this, it]() { handleExpireTimer(it); },
-                                      expireCycle)
-                  : netBase.timer.add([this, it]() { handleCleanTimer(it); },
-                                      cleanCycle)};
-      if (metric < METRIC_INF) {
-        matchTable.setEntry({
-          addr : e.address,
-          mask : e.mask,
-          device : info.l2.device,
-          gateway : info.l3.header->src,
-        });
-      } else {
-        matchTable.delEntry(e.address, e.mask);
-      }
+    bool changed = r.second || metric != t.metric || gateway != t.gateway;
+    if (changed)
+      realUpdated = true;
+    if (!r.second && metric == METRIC_INF && t.metric < METRIC_INF)
+      routeDown(t);
+    t = TabEntry{
+        .device = info.l2.device,
+        .gateway = gateway,
+        .metric = metric,
+        .refreshTime = now,
+        .changed = changed || t.changed,
+        .holdDown = t.holdDown,
+        .altPaths = changed ? Vector<Path>() : std::move(t.altPaths)};
+    if (!changed)
+      continue;
+    if (metric < METRIC_INF) {
+      matchTable.setEntry({
+        addr : e.address,
+        mask : e.mask,
+        device : info.l2.device,
+        gateway : gateway,
+      });
+    } else {
+      matchTable.delEntry(e.address, e.mask);
     }
+    fibChanged();
   }
 
   // Triggered updates
   if (realUpdated)
-    sendUpdate();
-}
-
-void RIP::handleExpireTimer(Table::iterator it) {
-  matchTable.delEntry(it->first.addr, it->first.mask);
-  it->second.metric = METRIC_INF;
-  it->second.expire =
-      netBase.timer.add([this, it] { handleCleanTimer(it); }, cleanCycle);
-}
-
-void RIP::handleCleanTimer(Table::iterator it) {
-  table.erase(it);
+    triggerUpdate();
 }
 
 void RIP::handleUpdateTimer() {
+  // The full update carries all the changes.
+  if (triggerTask) {
+    netBase.timer.remove(triggerTask);
+    triggerTask = nullptr;
+  }
   sendUpdate();
   updateTask =
       netBase.timer.add([this]() { handleUpdateTimer(); }, updateCycle);
 }
+
+void RIP::handleSweepTimer() {
+  auto now = Timer::Clock::now();
+  bool expired = false;
+  for (auto it = table.begin(); it != table.end();) {
+    auto &&t = it->second;
+    if (t.refreshTime == Timer::TimePoint()) {
+      it++;
+    } else if (t.metric < METRIC_INF) {
+      size_t nPaths = t.altPaths.size();
+      t.altPaths.erase(std::remove_if(t.altPaths.begin(), t.altPaths.end(),
+                                      [&](const Path &p) {
+                                        return now - p.refreshTime >=
+                                               expireCycle;
+                                      }),
+                       t.altPaths.end());
+      bool expiring = now - t.refreshTime >= expireCycle;
+      if (expiring && !t.altPaths.empty()) {
+        promoteAltPath(it->first, t);
+      } else if (!expiring && t.altPaths.size() != nPaths) {
+        installPaths(it->first, t);
+      } else if (expiring) {
+        matchTable.delEntry(it->first.addr, it->first.mask);
+        routeDown(t);
+        fibChanged();
+        t.metric = METRIC_INF;
+        t.refreshTime = now;
+        t.changed = true;
+        expired = true;
+      }
+      it++;
+    } else if (now - t.refreshTime >= cleanCycle) {
+      it = table.erase(it);
+    } else {
+      it++;
+    }
+  }
+  if (expired)
+    triggerUpdate();
+
+  // Aging is checked in 1/16 of the shorter cycle.
+  sweepTask = netBase.timer.add([this]() { handleSweepTimer(); },
+                                std::min(expireCycle, cleanCycle) / 16);
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 
 #include <mutex>
@@ -5,16 +6,22 @@
 #include <arpa/inet.h>
 
 #include "TCP.h"
+#include "CongestionControl.h"
 
 #include "utils.h"
 #include "log.h"
 
 TCP::TCP(L3 &l3_)
     : dispatcher(l3_.l2.netBase.dispatcher), timer(l3_.l2.netBase.timer),
-      l3(l3_), rnd(Timer::Clock::now().time_since_epoch().count()) {}
+      l3(l3_), rnd(Timer::Clock::now().time_since_epoch().count()),
+      rcvBufSize(BUF_SIZE), sndBufSize(BUF_SIZE), sackPermitted(true),
+      newCongestionControl(
+          []() -> CongestionControl * { return new NewReno(); }),
+      icmpHandler(*this) {}
 
 TCP::~TCP() {
   dispatcher.invoke([this]() {
+    l3.icmp.removeRecvCallback(&icmpHandler);
     for (auto &&e : listeners)
       delete e.second;
     for (auto &&e : connections)
@@ -47,6 +54,13 @@ bool TCP::seqLt(uint32_t a, uint32_t b) {
   return (int32_t)(b - a) > 0;
 }
 
+void TCP::CongestionControl::init(uint32_t mss) {
+  // The initial window (RFC 6928).
+  cwnd = std::min(10 * mss, std::max(2 * mss, 14600U));
+  ssthresh = UINT32_MAX;
+  pacingRate = 0;
+}
+
 int TCP::setup() {
   l3.addOnRecv(
       [this](auto &&...args) -> int {
@@ -54,6 +68,29 @@ int TCP::setup() {
         return 0;
       },
       PROTOCOL_ID);
+  l3.icmp.addRecvCallback(&icmpHandler);
+  l3.l2.netBase.addOnBurstEnd([this]() { flushAcks(); });
+  return 0;
+}
+
+TCP::IcmpHandler::IcmpHandler(TCP &tcp_) : ICMP::RecvCallback(3), tcp(tcp_) {}
+
+int TCP::IcmpHandler::handle(const void *data, int dataLen, const Info &info) {
+  if (info.icmpHeader->code != 4 || dataLen < (int)sizeof(L3::Header))
+    return 0;
+  // The quoted header, the ports and the sequence number.
+  const L3::Header &orig = *(const L3::Header *)data;
+  int hdrLen = (orig.versionAndIHL & 0x0f) * 4;
+  if (orig.protocol != PROTOCOL_ID || dataLen < hdrLen + 8)
+    return 0;
+  const Header &h = *(const Header *)((const char *)data + hdrLen);
+  Sock local{.addr = orig.src, .port = ntohs(h.srcPort)};
+  Sock foreign{.addr = orig.dst, .port = ntohs(h.dstPort)};
+  auto it = tcp.connections.find({local, foreign});
+  if (it != tcp.connections.end())
+    it->second->handlePathMtu(
+        ntohl(h.seqNum),
+        ICMP::getFragNeededMtu(*info.icmpHeader, data, dataLen));
   return 0;
 }
 
@@ -131,10 +168,13 @@ TCP::Connection *TCP::connect(Desc *desc, Sock dst) {
 }
 
 int TCP::sendSeg(const void *data, size_t dataLen, const Header &header,
-                 L3::Addr src, L3::Addr dst) {
-  assert(dataLen <= SIZE_MAX - sizeof(Header));
+                 L3::Addr src, L3::Addr dst, const void *options,
+                 size_t optionsLen) {
+  assert(dataLen <= SIZE_MAX - sizeof(Header) - optionsLen);
+  assert(optionsLen % 4 == 0);
 
-  size_t tcpLen = dataLen + sizeof(Header);
+  size_t hdrLen = sizeof(Header) + optionsLen;
+  size_t tcpLen = dataLen + hdrLen;
   void *seg = malloc(tcpLen);
   if (!seg) {
     LOG_ERR_POSIX("malloc");
@@ -144,17 +184,19 @@ int TCP::sendSeg(const void *data, size_t dataLen, const Header &header,
   Header &sendHeader = *(Header *)seg;
   sendHeader = header;
   if (sendHeader.offAndRsrv == 0)
-    sendHeader.offAndRsrv = (sizeof(Header) / 4) << 4;
+    sendHeader.offAndRsrv = (hdrLen / 4) << 4;
   sendHeader.checksum = 0;
 
+  if (optionsLen)
+    memcpy(&sendHeader + 1, options, optionsLen);
   if (dataLen)
-    memcpy(&sendHeader + 1, data, dataLen);
+    memcpy((char *)seg + hdrLen, data, dataLen);
 
   sendHeader.checksum = checksum(seg, tcpLen, src, dst);
   NS_ASSERT(checksum(seg, tcpLen, src, dst) == 0);
 
   int rc = l3.send(seg, tcpLen, src, dst, PROTOCOL_ID,
-                   {.timeToLive = 60, .autoRetry = true});
+                   {.timeToLive = 60, .autoRetry = true, .dontFragment = true});
   free(seg);
   return rc;
 }
@@ -236,6 +278,15 @@ void TCP::removeConnection(Connection *conn) {
   delete conn;
 }
 
+void TCP::flushAcks() {
+  for (auto *conn : ackDue) {
+    conn->isAckQueued = false;
+    if (conn->isAckDue)
+      conn->sendSeg(nullptr, 0, CTL_ACK);
+  }
+  ackDue.clear();
+}
+
 TCP::Listener::Listener(const Desc &desc) : Desc(desc), isClosed(false) {}
 
 TCP::Listener::~Listener() {
@@ -327,9 +378,34 @@ int TCP::Listener::awaitClose() {
 }
 
 TCP::Connection::Connection(const Desc &desc, Sock foreign_)
-    : Desc(desc), foreign(foreign_), mss(MSS), isReset(false), hRcv(0), tRcv(0),
-      uRcv(0), timeWait(nullptr),
-      rcvWnd(std::min((uint32_t)UINT16_MAX, BUF_SIZE)) {}
+    : Desc(desc), foreign(foreign_), noDelay(false),
+      mss(tcp.l3.getMtu(foreign.addr) - sizeof(L3::Header) - sizeof(Header)),
+      isReset(false), hRcv(0), tRcv(0), uRcv(0),
+      rcvBuf((char *)malloc(tcp.rcvBufSize)), rcvBufSize(tcp.rcvBufSize),
+      sndBuf((char *)malloc(tcp.sndBufSize)), sndBufSize(tcp.sndBufSize),
+      hSnd(0), isFinQueued(false),
+      timeWait(nullptr), maxSndWnd(0), srtt(0), rttVar(0), rto(INITIAL_RTO),
+      cc(tcp.newCongestionControl()), rtoTimer(nullptr), isRtoBackoff(false),
+      dupAcks(0), inRecovery(false), inflation(0), sackedBytes(0), minRtt(0),
+      rackRtt(0), rackTimer(nullptr), tlpTimer(nullptr), persistTimer(nullptr),
+      delivered(0), paceTimer(nullptr),
+      sndWndShift(0), wndScale(true), sackOk(tcp.sackPermitted), rcvWnd(0),
+      rcvUnAcked(0), delAckTimer(nullptr), isAckDue(false),
+      isSmlUnAcked(false), isAckQueued(false), rcvWndShift(0) {
+  cc->init(mss);
+  if (!rcvBuf) {
+    LOG_ERR_POSIX("malloc");
+    rcvBufSize = 0;
+  }
+  if (!sndBuf) {
+    LOG_ERR_POSIX("malloc");
+    sndBufSize = 0;
+  }
+  while (rcvWndShift < MAX_WND_SHIFT &&
+         (rcvBufSize >> rcvWndShift) > UINT16_MAX)
+    rcvWndShift++;
+  updateRcvWnd();
+}
 
 TCP::Connection::~Connection() {
   isReset = true;
@@ -340,12 +416,24 @@ TCP::Connection::~Connection() {
   }
   removeSegments();
   notifyAll();
+  if (paceTimer)
+    tcp.timer.remove(paceTimer);
+  if (delAckTimer)
+    tcp.timer.remove(delAckTimer);
+  if (isAckQueued)
+    tcp.ackDue.erase(std::find(tcp.ackDue.begin(), tcp.ackDue.end(), this));
+  free(rcvBuf);
+  free(sndBuf);
+  delete cc;
 }
 
 void TCP::Connection::removeSegments() {
-  for (auto &&e : sndInfo)
-    tcp.timer.remove(e.retrans);
   sndInfo.clear();
+  for (auto **task : {&rtoTimer, &rackTimer, &tlpTimer, &persistTimer}) {
+    if (*task)
+      tcp.timer.remove(*task);
+    *task = nullptr;
+  }
 }
 
 void TCP::Connection::notifyAll() {
@@ -367,6 +455,12 @@ void TCP::Connection::notifyAll() {
   }
 }
 
+void TCP::Connection::setCongestionControl(CongestionControl *cc_) {
+  delete cc;
+  cc = cc_;
+  cc->init(mss);
+}
+
 int TCP::Connection::bind(Sock sock) {
   LOG_ERR("Unsupported bind to a listener");
   return -1;
@@ -403,7 +497,7 @@ int TCP::Connection::awaitClose() {
     case St::SYN_RECEIVED: {
       if (sndNxt == initSndSeq + 1 && pdSnd.empty()) {
         state = St::FIN_WAIT_1;
-        addSendSeg(nullptr, 0, CTL_FIN | CTL_ACK);
+        addSendSeg(0, CTL_FIN | CTL_ACK);
         onClose.push([&ret]() { return ret(0); });
       } else {
         onEstab.push(close);
@@ -412,9 +506,10 @@ int TCP::Connection::awaitClose() {
     }
 
     case St::ESTABLISHED: {
-      state = St::FIN_WAIT_1;
       if (pdSnd.empty()) {
-        addSendSeg(nullptr, 0, CTL_FIN | CTL_ACK);
+        state = St::FIN_WAIT_1;
+        isFinQueued = true;
+        output();
         onClose.push([&ret]() { return ret(0); });
       } else {
         pdSnd.push(close);
@@ -431,11 +526,13 @@ int TCP::Connection::awaitClose() {
     case St::CLOSE_WAIT: {
       if (pdSnd.empty()) {
         state = St::CLOSING;
-        addSendSeg(nullptr, 0, CTL_FIN | CTL_ACK);
+        isFinQueued = true;
+        output();
         return ret(0);
       } else {
         pdSnd.push(close);
       }
+      break;
     }
 
     case St::CLOSING:
@@ -460,18 +557,22 @@ ssize_t TCP::Connection::recv(void *data, size_t maxLen) {
   if (maxLen < dataLen)
     dataLen = maxLen;
   uRcv -= dataLen;
-  if (hRcv + dataLen <= BUF_SIZE) {
+  if (hRcv + dataLen <= rcvBufSize) {
     memcpy(data, rcvBuf + hRcv, dataLen);
   } else {
-    uint32_t n0 = BUF_SIZE - hRcv;
+    uint32_t n0 = rcvBufSize - hRcv;
     memcpy(data, rcvBuf + hRcv, n0);
     memcpy((char *)data + n0, rcvBuf, dataLen - n0);
   }
-  hRcv = (hRcv + dataLen) % BUF_SIZE;
-
-  uint32_t prvRcvWnd = rcvWnd;
-  rcvWnd = std::min((uint32_t)UINT16_MAX, BUF_SIZE - uRcv);
-  if (rcvWnd > prvRcvWnd)
+  hRcv = (hRcv + dataLen) % rcvBufSize;
+
+  updateRcvWnd();
+  // Only worth an update if the peer knows less than half the buffer, the
+  // ACKs of the data in flight carry the rest. A small segment read up is
+  // the end of a write, whose sender may wait for the ACK by Nagle.
+  uint32_t peerWnd = rcvWndEdge - rcvNxt;
+  if ((rcvWnd > peerWnd && peerWnd < rcvBufSize / 2) ||
+      (isSmlUnAcked && !uRcv))
     sendSeg(nullptr, 0, CTL_ACK);
   return dataLen;
 }
@@ -535,17 +636,25 @@ ssize_t TCP::Connection::awaitRecv(void *data, size_t maxLen) {
 }
 
 ssize_t TCP::Connection::send(const void *data, size_t dataLen) {
-  if (sndNxt - sndUnAck >= sndWnd)
+  uint32_t len = std::min((size_t)(sndBufSize - (sndEnd - sndUnAck)), dataLen);
+  if (!len)
     return 0;
-  uint32_t maxLen = std::min(mss, sndWnd - (sndNxt - sndUnAck));
-  if (dataLen > maxLen)
-    dataLen = maxLen;
-  assert(dataLen > 0);
-  addSendSeg(data, dataLen, CTL_ACK);
-  return dataLen;
+  uint32_t p = (hSnd + (sndEnd - sndUnAck)) % sndBufSize;
+  if (p + len <= sndBufSize) {
+    memcpy(sndBuf + p, data, len);
+  } else {
+    uint32_t n0 = sndBufSize - p;
+    memcpy(sndBuf + p, data, n0);
+    memcpy(sndBuf, (const char *)data + n0, len - n0);
+  }
+  sndEnd += len;
+  output();
+  return len;
 }
 
 ssize_t TCP::Connection::asyncSend(const void *data, size_t dataLen) {
+  if (!dataLen)
+    return 0;
   ssize_t rc;
   std::mutex finish;
   finish.lock();
@@ -575,11 +684,9 @@ ssize_t TCP::Connection::asyncSend(const void *data, size_t dataLen) {
 
     case St::ESTABLISHED:
     case St::CLOSE_WAIT: {
-      if (sndNxt - sndUnAck < sndWnd) {
-        return ret(send(data, dataLen));
-      } else {
-        pdSnd.push(put);
-      }
+      if (ssize_t len = send(data, dataLen))
+        return ret(len);
+      pdSnd.push(put);
       break;
     }
 
@@ -608,74 +715,216 @@ ssize_t TCP::Connection::asyncSendAll(const void *data, size_t dataLen) {
 
 int TCP::Connection::sendSeg(const void *data, uint32_t dataLen, uint8_t ctrl,
                              uint32_t seqNum) {
+  if (ctrl & CTL_ACK) {
+    // Any ACK acknowledges all the data received.
+    rcvUnAcked = 0;
+    isAckDue = isSmlUnAcked = false;
+    if (delAckTimer) {
+      tcp.timer.remove(delAckTimer);
+      delAckTimer = nullptr;
+    }
+  }
+  rcvWndEdge = rcvNxt + rcvWnd;
+  uint8_t options[40];
+  size_t optionsLen = 0;
+  // Windows in SYNs are never scaled.
+  uint32_t window = std::min((ctrl & CTL_SYN) ? rcvWnd : rcvWnd >> rcvWndShift,
+                             (uint32_t)UINT16_MAX);
+  if (ctrl & CTL_SYN) {
+    // The MSS we can receive, by the device and not the path (RFC 6691).
+    uint16_t rcvMss = htons(tcp.l3.getDeviceMtu(foreign.addr) -
+                            sizeof(L3::Header) - sizeof(Header));
+    options[optionsLen++] = OPT_MSS;
+    options[optionsLen++] = 4;
+    memcpy(options + optionsLen, &rcvMss, sizeof(rcvMss));
+    optionsLen += sizeof(rcvMss);
+    if (wndScale) {
+      options[optionsLen++] = OPT_NOP;
+      options[optionsLen++] = OPT_WSCALE;
+      options[optionsLen++] = 3;
+      options[optionsLen++] = rcvWndShift;
+    }
+    if (sackOk) {
+      options[optionsLen++] = OPT_NOP;
+      options[optionsLen++] = OPT_NOP;
+      options[optionsLen++] = OPT_SACK_PERMITTED;
+      options[optionsLen++] = 2;
+    }
+  } else if (sackOk && !dataLen && (ctrl & CTL_ACK) && !rcvInfo.empty()) {
+    // The block of the latest segment first, then the highest others.
+    SegInfo blocks[MAX_SACK_BLOCKS];
+    int n = 0;
+    auto last = rcvInfo.upper_bound({lastRcvSeq, UINT32_MAX});
+    if (last != rcvInfo.begin())
+      blocks[n++] = *--last;
+    for (auto it = rcvInfo.rbegin(); it != rcvInfo.rend() && n < MAX_SACK_BLOCKS;
+         ++it)
+      if (!n || it->begin != blocks[0].begin)
+        blocks[n++] = *it;
+    options[optionsLen++] = OPT_NOP;
+    options[optionsLen++] = OPT_NOP;
+    options[optionsLen++] = OPT_SACK;
+    options[optionsLen++] = 2 + 8 * n;
+    for (int i = 0; i < n; i++) {
+      uint32_t edges[2] = {htonl(blocks[i].begin), htonl(blocks[i].end)};
+      memcpy(options + optionsLen, edges, sizeof(edges));
+      optionsLen += sizeof(edges);
+    }
+  }
   return tcp.sendSeg(data, dataLen,
                      {.srcPort = htons(local.port),
                       .dstPort = htons(foreign.port),
                       .seqNum = htonl(seqNum),
                       .ackNum = (ctrl & CTL_ACK) ? htonl(rcvNxt) : 0,
                       .ctrl = ctrl,
-                      .window = htons(std::min(rcvWnd, (uint32_t)UINT16_MAX))},
-                     local.addr, foreign.addr);
+                      .window = htons(window)},
+                     local.addr, foreign.addr, options, optionsLen);
 }
 
 int TCP::Connection::sendSeg(const void *data, uint32_t dataLen, uint8_t ctrl) {
   return sendSeg(data, dataLen, ctrl, sndNxt);
 }
 
-void TCP::Connection::addSendSeg(const void *data, uint32_t dataLen,
-                                 uint8_t ctrl) {
+int TCP::Connection::sendData(uint32_t seq, uint32_t dataLen, uint8_t ctrl) {
+  if (!dataLen)
+    return sendSeg(nullptr, 0, ctrl, seq);
+  uint32_t p = (hSnd + (seq - sndUnAck)) % sndBufSize;
+  if (p + dataLen <= sndBufSize)
+    return sendSeg(sndBuf + p, dataLen, ctrl, seq);
+  // Wrapped around the end of the ring.
+  char *data = (char *)malloc(dataLen);
+  if (!data) {
+    LOG_ERR_POSIX("malloc");
+    return -1;
+  }
+  uint32_t n0 = sndBufSize - p;
+  memcpy(data, sndBuf + p, n0);
+  memcpy(data + n0, sndBuf, dataLen - n0);
+  int rc = sendSeg(data, dataLen, ctrl, seq);
+  free(data);
+  return rc;
+}
+
+void TCP::Connection::addSendSeg(uint32_t dataLen, uint8_t ctrl) {
   uint32_t segLen = dataLen;
   if (ctrl & CTL_SYN)
     segLen++;
   if (ctrl & CTL_FIN)
     segLen++;
 
-  void *dataCopy = nullptr;
-  if (dataLen) {
-    dataCopy = malloc(dataLen);
-    if (!dataCopy) {
-      LOG_ERR_POSIX("malloc");
-      return;
-    }
-    memcpy(dataCopy, data, dataLen);
+  sendData(sndNxt, dataLen, ctrl);
+
+  Timer::TimePoint now = Timer::Clock::now();
+  if (sndInfo.empty())
+    firstSentTime = deliveredTime = now;
+  if (cc->pacingRate > 0) {
+    std::chrono::duration<double> gap(segLen / cc->pacingRate);
+    nextSendTime = std::max(nextSendTime, now) +
+                   std::chrono::duration_cast<Timer::Duration>(gap);
   }
+  sndInfo.insert({sndNxt, sndNxt + segLen, dataLen, ctrl, now, false,
+                  delivered, deliveredTime, firstSentTime, false});
 
-  int rc = sendSeg(data, dataLen, ctrl);
+  sndNxt += segLen;
+  if (!rtoTimer)
+    armRto();
+  if (!tlpTimer)
+    armTlp();
+}
 
-  auto it =
-      sndInfo.insert({sndNxt, sndNxt + segLen, dataCopy, dataLen, ctrl}).first;
+void TCP::Connection::armRto() {
+  if (rtoTimer)
+    tcp.timer.remove(rtoTimer);
+  rtoTimer = nullptr;
+  if (sndInfo.empty())
+    return;
+  // An RTO after the oldest was sent, not after the last ACK, so a lost
+  // segment is not held back by the ACKs of those before it (RFC 7765).
+  Timer::Duration timeout =
+      sndInfo.begin()->sentTime + rto - Timer::Clock::now();
+  rtoTimer = tcp.timer.add([this]() { handleRto(); },
+                           std::max(timeout, Timer::Duration(0)));
+}
 
-  Timer::Handler retrans = [this, it]() {
-    if (seqLe(sndUnAck, it->begin)) {
-      sendSeg(it->data, it->dataLen, it->ctrl, it->begin);
-    } else {
-      uint32_t p = 0;
-      uint8_t ctrl = it->ctrl;
-      uint32_t rem = it->end - sndUnAck;
-      if ((ctrl & (CTL_SYN | CTL_FIN)) && rem) {
-        rem--;
-        ctrl &= ~CTL_SYN | CTL_FIN;
-      }
-      uint32_t off = it->dataLen - rem;
-      sendSeg((char *)it->data + off, rem, ctrl, sndUnAck);
-    }
-    it->retrans = tcp.timer.add(it->retrans->handler, RETRANS_TIMEOUT);
-  };
-  it->retrans = tcp.timer.add(retrans, RETRANS_TIMEOUT);
+void TCP::Connection::handleRto() {
+  rtoTimer = nullptr;
+  if (sndInfo.empty())
+    return;
+  rto = std::min(rto * 2, MAX_RTO);
+  const SndSegInfo &seg = *sndInfo.begin();
+  // React once per loss: the backoffs of the same segment only resend it.
+  if (!isRtoBackoff) {
+    isRtoBackoff = true;
+    cc->onLoss({.inFlight = sndNxt - sndUnAck,
+                .mss = mss,
+                .isTimeout = true,
+                .now = Timer::Clock::now()});
+    recover = sndNxt;
+    dupAcks = 0;
+    inRecovery = false;
+    inflation = 0;
+    rtxNxt = seg.end;
+  }
+  seg.isRetransmitted = true;
+  retransmit(seg);
+  armRto();
+}
 
-  sndNxt += segLen;
+void TCP::Connection::retransmit(const SndSegInfo &seg) {
+  seg.sentTime = Timer::Clock::now();
+  uint32_t seq = seqLt(seg.begin, sndUnAck) ? sndUnAck : seg.begin;
+  uint8_t ctrl = seg.ctrl;
+  uint32_t off = seq - seg.begin;
+  if ((ctrl & CTL_SYN) && off) {
+    ctrl &= ~CTL_SYN;
+    off--;
+  }
+  off = std::min(off, seg.dataLen);
+  do {
+    uint32_t len = std::min(mss, seg.dataLen - off);
+    uint8_t segCtrl = off + len == seg.dataLen ? ctrl : ctrl & ~CTL_FIN;
+    sendData(seq, len, segCtrl);
+    seq += len + ((segCtrl & CTL_SYN) ? 1 : 0);
+    ctrl &= ~CTL_SYN;
+    off += len;
+  } while (off < seg.dataLen);
+}
+
+void TCP::Connection::handlePathMtu(uint32_t seq, size_t mtu) {
+  // Not for data in flight: a stale or forged error (RFC 5927). Only then
+  // is the path MTU cached, for the other connections too.
+  if (seqLt(seq, sndUnAck) || !seqLt(seq, sndNxt))
+    return;
+  tcp.l3.lowerPathMtu(foreign.addr, mtu);
+  uint32_t pathMss =
+      tcp.l3.getMtu(foreign.addr) - sizeof(L3::Header) - sizeof(Header);
+  if (pathMss >= mss)
+    return;
+  LOG_INFO("MSS lowered to %u by the path MTU", pathMss);
+  mss = pathMss;
+  // The larger ones were dropped on the path. They are resent in order as
+  // the congestion window allows, like after a timeout.
+  for (auto &&seg : sndInfo)
+    if (seg.dataLen > mss && !seg.isSacked)
+      seg.isRetransmitted = true;
+  rtxNxt = sndUnAck;
+  recover = sndNxt;
+  output();
 }
 
 void TCP::Connection::connect() {
   initSndSeq = genInitSeqNum();
   sndUnAck = initSndSeq;
   sndNxt = initSndSeq;
-  addSendSeg(nullptr, 0, CTL_SYN);
+  recover = rtxNxt = rackEndSeq = sndSmlEnd = initSndSeq;
+  sndEnd = initSndSeq + 1;
+  addSendSeg(0, CTL_SYN);
   state = St::SYN_SENT;
 }
 
 int TCP::Connection::establish() {
   state = St::ESTABLISHED;
+  cc->init(mss); // With the MSS negotiated
   LOG_INFO("Connection established");
   while (!onEstab.empty()) {
     onEstab.front()();
@@ -685,40 +934,425 @@ int TCP::Connection::establish() {
 }
 
 void TCP::Connection::advanceUnAck(uint32_t ack) {
-  uint32_t ackNum = ack - sndUnAck;
+  uint32_t inFlight = sndNxt - sndUnAck;
+  uint32_t ackedLen = ack - sndUnAck;
   sndUnAck = ack;
+  // Sample by the latest segment acknowledged, unless the ACK covers a
+  // retransmission (Karn's algorithm).
+  Timer::TimePoint now = Timer::Clock::now(), sentTime;
+  Timer::TimePoint priorDeliveredTime, priorFirstSentTime;
+  uint64_t priorDelivered = delivered;
+  bool isSampled = true, isAcked = false;
   while (!sndInfo.empty() && seqLe(sndInfo.begin()->end, sndUnAck)) {
     auto p = sndInfo.begin();
-    tcp.timer.remove(p->retrans);
-    free(p->data);
+    isAcked = true;
+    isSampled = isSampled && !p->isRetransmitted;
+    sentTime = p->sentTime;
+    priorDelivered = p->delivered;
+    priorDeliveredTime = p->deliveredTime;
+    priorFirstSentTime = p->firstSentTime;
+    rackUpdate(*p, now);
+    // SYN and FIN are not data.
+    ackedLen -= (p->end - p->begin) - p->dataLen;
+    if (p->isSacked)
+      sackedBytes -= p->end - p->begin;
     sndInfo.erase(p);
   }
+  if (ackedLen)
+    hSnd = (hSnd + ackedLen) % sndBufSize;
+  delivered += ackedLen;
+  deliveredTime = now;
+  Timer::Duration rtt(0), rateInterval(0);
+  if (isAcked && isSampled) {
+    rtt = now - sentTime;
+    sampleRtt(rtt);
+    // The slower of the send and the ACK rate over the interval, so neither
+    // a burst of sends nor of ACKs overestimates it.
+    rateInterval =
+        std::max(sentTime - priorFirstSentTime, now - priorDeliveredTime);
+    firstSentTime = sentTime;
+  }
+  if (ackedLen)
+    cc->onAck({.ackedLen = ackedLen,
+               .inFlight = inFlight,
+               .mss = mss,
+               .rtt = rtt,
+               .srtt = srtt,
+               .now = now,
+               .inRecovery = inRecovery,
+               .delivered = delivered,
+               .priorDelivered = priorDelivered,
+               .rateDelivered = delivered - priorDelivered,
+               .rateInterval = rateInterval});
+
+  while (!sackInfo.empty() && seqLe(sackInfo.begin()->end, sndUnAck))
+    sackInfo.erase(sackInfo.begin());
+
+  dupAcks = 0;
+  if (inRecovery) {
+    if (seqLe(recover, sndUnAck)) {
+      inRecovery = false;
+      inflation = 0;
+    } else if (sackOk) {
+      // The holes are found lost by RACK.
+      inflation = sackedBytes;
+    } else {
+      // A partial ACK: the next hole is lost too (RFC 6582). Deflate by the
+      // data acknowledged, for the one segment resent.
+      inflation -= std::min(inflation, ackedLen);
+      inflation += mss;
+      if (!sndInfo.empty())
+        fastRetransmit(*sndInfo.begin());
+    }
+  }
+  if (seqLt(rtxNxt, sndUnAck))
+    rtxNxt = sndUnAck;
+  isRtoBackoff = false;
+  armRto();
+  armTlp();
+}
+
+void TCP::Connection::handleDupAck() {
+  if (inRecovery) {
+    if (sackOk) {
+      inflation = sackedBytes;
+    } else {
+      // Another segment received beyond the hole, but no more than were
+      // sent.
+      inflation = std::min(inflation + mss, recover - sndUnAck);
+    }
+    checkSend();
+    return;
+  }
+  // Not for the rest of a window already lost.
+  if (++dupAcks < DUP_THRESH || seqLt(sndUnAck, recover))
+    return;
+  enterRecovery();
+  fastRetransmit(*sndInfo.begin());
+  checkSend();
+}
+
+void TCP::Connection::enterRecovery() {
+  cc->onLoss({.inFlight = sndNxt - sndUnAck,
+              .mss = mss,
+              .isTimeout = false,
+              .now = Timer::Clock::now()});
+  recover = rtxNxt = sndNxt;
+  inRecovery = true;
+  inflation = sackOk ? sackedBytes : DUP_THRESH * mss;
+  if (tlpTimer) {
+    tcp.timer.remove(tlpTimer);
+    tlpTimer = nullptr;
+  }
+}
+
+void TCP::Connection::rackUpdate(const SndSegInfo &seg, Timer::TimePoint now) {
+  // Possibly the original acknowledged, not the retransmission.
+  if (seg.isRetransmitted && now - seg.sentTime < minRtt)
+    return;
+  if (seg.sentTime > rackXmitTime ||
+      (seg.sentTime == rackXmitTime && seqLt(rackEndSeq, seg.end))) {
+    rackXmitTime = seg.sentTime;
+    rackEndSeq = seg.end;
+    rackRtt = now - seg.sentTime;
+  }
+}
+
+void TCP::Connection::rackDetectLoss() {
+  if (rackTimer) {
+    tcp.timer.remove(rackTimer);
+    rackTimer = nullptr;
+  }
+  Timer::TimePoint now = Timer::Clock::now();
+  Timer::Duration reoWnd = std::min(minRtt / 4, srtt), wait(0);
+  // Sent before the latest segment delivered, by more than the reordering
+  // window: lost. Resent ones are sent after it, until it is updated.
+  for (auto &&seg : sndInfo) {
+    if (!seqLt(seg.begin, rackEndSeq))
+      break;
+    if (seg.isSacked || seg.sentTime > rackXmitTime)
+      continue;
+    // Left to be resent in order after a timeout.
+    if (seqLe(rtxNxt, seg.begin) && seqLt(seg.begin, recover))
+      continue;
+    Timer::Duration remaining = seg.sentTime + rackRtt + reoWnd - now;
+    if (remaining > Timer::Duration(0)) {
+      wait = std::max(wait, remaining);
+      continue;
+    }
+    if (!inRecovery && seqLe(recover, sndUnAck))
+      enterRecovery();
+    fastRetransmit(seg);
+  }
+  if (wait > Timer::Duration(0)) {
+    rackTimer = tcp.timer.add(
+        [this]() {
+          rackTimer = nullptr;
+          rackDetectLoss();
+        },
+        wait);
+  }
+}
+
+void TCP::Connection::armTlp() {
+  if (tlpTimer) {
+    tcp.timer.remove(tlpTimer);
+    tlpTimer = nullptr;
+  }
+  if (!sackOk || inRecovery || sndInfo.empty() ||
+      srtt == Timer::Duration(0))
+    return;
+  // Resend the last segment, for its loss or the others' to be reported by
+  // SACK rather than by the retransmission timeout. A single segment may
+  // wait for the peer's delayed ACK.
+  Timer::Duration pto = srtt * 2;
+  if (sndNxt - sndUnAck <= mss)
+    pto += MAX_PEER_ACK_DELAY;
+  tlpTimer = tcp.timer.add(
+      [this]() {
+        tlpTimer = nullptr;
+        if (!sndInfo.empty() && !sndInfo.rbegin()->isSacked)
+          fastRetransmit(*sndInfo.rbegin());
+      },
+      std::min(pto, rto));
+}
+
+void TCP::Connection::fastRetransmit(const SndSegInfo &seg) {
+  seg.isRetransmitted = true;
+  retransmit(seg);
+  // Not to time out at once, by the original transmission.
+  if (&seg == &*sndInfo.begin())
+    armRto();
+}
+
+void TCP::Connection::handleSack(const uint8_t *begin, const uint8_t *end) {
+  for (auto *p = begin; p < end;) {
+    uint8_t kind = *p++;
+    if (kind == OPT_END)
+      break;
+    if (kind == OPT_NOP)
+      continue;
+    if (p == end || *p < 2 || *p - 1 > end - p)
+      break; // Malformed
+    uint8_t len = *p;
+    if (kind == OPT_SACK) {
+      for (int i = 0; i + 8 <= len - 2; i += 8) {
+        uint32_t edges[2];
+        memcpy(edges, p + 1 + i, sizeof(edges));
+        markSacked(ntohl(edges[0]), ntohl(edges[1]));
+      }
+    }
+    p += len - 1;
+  }
+}
+
+void TCP::Connection::markSacked(uint32_t begin, uint32_t end) {
+  if (!seqLt(begin, end) || !seqLt(sndUnAck, end) || seqLt(sndNxt, end))
+    return; // Invalid or old
+  Timer::TimePoint now = Timer::Clock::now();
+  auto mark = [this, begin, end, now](uint32_t from, uint32_t to) {
+    auto it = sndInfo.lower_bound(SndSegInfo{{from, from}});
+    if (it != sndInfo.begin() && seqLt(from, std::prev(it)->end))
+      it--;
+    for (; it != sndInfo.end() && seqLt(it->begin, to); ++it) {
+      if (it->isSacked || seqLt(it->begin, begin) || seqLt(end, it->end))
+        continue;
+      it->isSacked = true;
+      sackedBytes += it->end - it->begin;
+      rackUpdate(*it, now);
+    }
+  };
+  // The gaps between the ranges SACKed before.
+  uint32_t p = begin;
+  auto it = sackInfo.lower_bound({begin, begin});
+  if (it != sackInfo.begin() && seqLt(begin, std::prev(it)->end))
+    it--;
+  for (; it != sackInfo.end() && seqLt(it->begin, end); ++it) {
+    if (seqLt(p, it->begin))
+      mark(p, it->begin);
+    if (seqLt(p, it->end))
+      p = it->end;
+  }
+  if (seqLt(p, end))
+    mark(p, end);
+  addBlock(sackInfo, {begin, end});
+}
+
+void TCP::Connection::addBlock(OrdSet<SegInfo> &blocks, SegInfo block) {
+  auto it = blocks.lower_bound({block.begin, block.begin});
+  if (it != blocks.begin() && seqLe(block.begin, std::prev(it)->end))
+    it--;
+  while (it != blocks.end() && seqLe(it->begin, block.end)) {
+    if (seqLt(it->begin, block.begin))
+      block.begin = it->begin;
+    if (seqLt(block.end, it->end))
+      block.end = it->end;
+    it = blocks.erase(it);
+  }
+  blocks.insert(block);
+}
+
+void TCP::Connection::sampleRtt(Timer::Duration rtt) {
+  if (minRtt == Timer::Duration(0) || rtt < minRtt)
+    minRtt = rtt;
+  if (srtt == Timer::Duration(0)) {
+    srtt = rtt;
+    rttVar = rtt / 2;
+  } else {
+    Timer::Duration delta = srtt > rtt ? srtt - rtt : rtt - srtt;
+    rttVar = (rttVar * 3 + delta) / 4;
+    srtt = (srtt * 7 + rtt) / 8;
+  }
+  rto = srtt + std::max(CLOCK_GRANULARITY, rttVar * 4);
+  rto = std::min(std::max(rto, MIN_RTO), MAX_RTO);
+}
+
+uint32_t TCP::Connection::flightLimit() const {
+  return std::min(sndWnd, cc->cwnd + inflation);
+}
+
+uint32_t TCP::Connection::sendableLen(size_t dataLen) {
+  uint32_t inFlight = sndNxt - sndUnAck, limit = flightLimit();
+  if (!sndWnd && !inFlight) {
+    // No ACK to come to open the window.
+    if (!persistTimer)
+      persist(rto);
+    return 0;
+  }
+  if (inFlight >= limit || !checkPacing())
+    return 0;
+  uint32_t len = std::min((size_t)std::min(mss, limit - inFlight), dataLen);
+  // Full segments, or anything if nothing is in flight to be acknowledged.
+  if (len == mss || !inFlight)
+    return len;
+  // Cut by the window, until it opens by half the largest offered.
+  if (len < dataLen)
+    return len >= maxSndWnd / 2 ? len : 0;
+  // The end of a write: one small segment unacknowledged at most (the
+  // Nagle algorithm, by Minshall's variant).
+  return noDelay || !seqLt(sndUnAck, sndSmlEnd) ? len : 0;
+}
+
+bool TCP::Connection::checkPacing() {
+  if (cc->pacingRate <= 0)
+    return true;
+  Timer::TimePoint now = Timer::Clock::now();
+  if (!seqLt(sndUnAck, sndNxt) || nextSendTime <= now)
+    return true;
+  if (!paceTimer) {
+    paceTimer = tcp.timer.add(
+        [this]() {
+          paceTimer = nullptr;
+          checkSend();
+        },
+        nextSendTime - now);
+  }
+  return false;
 }
 
 void TCP::Connection::checkSend() {
-  while (sndNxt - sndUnAck < sndWnd && !pdSnd.empty()) {
-    pdSnd.front()();
+  output();
+  while (!pdSnd.empty() && sndEnd - sndUnAck < sndBufSize) {
+    size_t n = pdSnd.size();
+    WaitHandler handler = pdSnd.front();
     pdSnd.pop();
+    handler();
+    // Put back to wait for space.
+    if (pdSnd.size() == n)
+      break;
+  }
+  if (persistTimer && (sndWnd || seqLt(sndUnAck, sndNxt))) {
+    tcp.timer.remove(persistTimer);
+    persistTimer = nullptr;
+  }
+}
+
+void TCP::Connection::output() {
+  // After a timeout, the rest of the window is resent before new data, as
+  // the congestion window allows (slow start from the oldest).
+  while (seqLt(rtxNxt, recover) && rtxNxt - sndUnAck < cc->cwnd) {
+    auto it = sndInfo.lower_bound(SndSegInfo{{rtxNxt, rtxNxt}});
+    if (it != sndInfo.begin() && seqLt(rtxNxt, std::prev(it)->end))
+      --it;
+    if (it == sndInfo.end())
+      break;
+    if (!it->isSacked) {
+      it->isRetransmitted = true;
+      retransmit(*it);
+    }
+    rtxNxt = it->end;
+  }
+  while (seqLt(sndNxt, sndEnd)) {
+    uint32_t len = sendableLen(sndEnd - sndNxt);
+    if (!len)
+      break;
+    addSendSeg(len, CTL_ACK);
+    if (len < mss)
+      sndSmlEnd = sndNxt;
+  }
+  if (isFinQueued && sndNxt == sndEnd) {
+    isFinQueued = false;
+    addSendSeg(0, CTL_FIN | CTL_ACK);
+  }
+}
+
+void TCP::Connection::persist(Timer::Duration timeout) {
+  persistTimer = tcp.timer.add(
+      [this, timeout]() {
+        // An old sequence number, for the peer to ACK with its window
+        // (RFC 9293 3.8.6.1).
+        sendSeg(nullptr, 0, CTL_ACK, sndUnAck - 1);
+        persist(std::min(timeout * 2, MAX_RTO));
+      },
+      timeout);
+}
+
+void TCP::Connection::delayAck(uint32_t dataLen) {
+  rcvUnAcked += dataLen;
+  if (dataLen < mss)
+    isSmlUnAcked = true;
+  if (rcvUnAcked >= 2 * mss) {
+    isAckDue = true;
+    if (!isAckQueued) {
+      isAckQueued = true;
+      tcp.ackDue.push_back(this);
+    }
+  } else if (!delAckTimer) {
+    delAckTimer = tcp.timer.add(
+        [this]() {
+          delAckTimer = nullptr;
+          sendSeg(nullptr, 0, CTL_ACK);
+        },
+        DELAYED_ACK_TIMEOUT);
   }
 }
 
 void TCP::Connection::deliverData(const void *data, uint32_t dataLen,
                                   uint32_t segSeq) {
+  // Trim the part received before.
+  if (seqLt(segSeq, rcvNxt)) {
+    uint32_t dupLen = rcvNxt - segSeq;
+    if (dupLen >= dataLen)
+      return;
+    data = (const char *)data + dupLen;
+    dataLen -= dupLen;
+    segSeq = rcvNxt;
+  }
   // rcvNxt --- tRcv
   uint32_t maxLen = rcvWnd - (segSeq - rcvNxt);
   if (dataLen > maxLen)
     dataLen = maxLen;
-  uint32_t p = (tRcv + (segSeq - rcvNxt)) % BUF_SIZE;
+  uint32_t p = (tRcv + (segSeq - rcvNxt)) % rcvBufSize;
 
-  if (p + dataLen <= BUF_SIZE) {
+  if (p + dataLen <= rcvBufSize) {
     memcpy(rcvBuf + p, data, dataLen);
   } else {
-    uint32_t n0 = BUF_SIZE - p;
+    uint32_t n0 = rcvBufSize - p;
     memcpy(rcvBuf + p, data, n0);
     memcpy(rcvBuf, (const char *)data + n0, dataLen - n0);
   }
 
-  rcvInfo.insert({segSeq, segSeq + dataLen});
+  addBlock(rcvInfo, {segSeq, segSeq + dataLen});
   if (segSeq == rcvNxt) {
     uint32_t prvRcvNxt = rcvNxt;
     while (!rcvInfo.empty() && seqLe(rcvInfo.begin()->begin, rcvNxt)) {
@@ -726,9 +1360,13 @@ void TCP::Connection::deliverData(const void *data, uint32_t dataLen,
         rcvNxt = rcvInfo.begin()->end;
       rcvInfo.erase(rcvInfo.begin());
     }
-    tRcv = (tRcv + (rcvNxt - prvRcvNxt)) % BUF_SIZE;
+    tRcv = (tRcv + (rcvNxt - prvRcvNxt)) % rcvBufSize;
     uRcv += rcvNxt - prvRcvNxt;
-    rcvWnd = std::min((uint32_t)UINT16_MAX, BUF_SIZE - uRcv);
+    // The right edge stays.
+    rcvWnd -= rcvNxt - prvRcvNxt;
+    updateRcvWnd();
+  } else {
+    lastRcvSeq = segSeq;
   }
 
   while (uRcv && !pdRcv.empty()) {
@@ -737,6 +1375,13 @@ void TCP::Connection::deliverData(const void *data, uint32_t dataLen,
   }
 }
 
+void TCP::Connection::updateRcvWnd() {
+  uint32_t space =
+      std::min(rcvBufSize - uRcv, (uint32_t)UINT16_MAX << rcvWndShift);
+  if (space < rcvWnd || space - rcvWnd >= std::min(rcvBufSize / 2, mss))
+    rcvWnd = space;
+}
+
 void TCP::Connection::handleRecvListen(Listener *listener_, const void *data,
                                        size_t dataLen, const RecvInfo &info) {
   const Header &h = *info.header;
@@ -749,32 +1394,56 @@ void TCP::Connection::handleRecvListen(Listener *listener_, const void *data,
   initSndSeq = genInitSeqNum();
   sndUnAck = initSndSeq;
   sndNxt = initSndSeq;
-  addSendSeg(nullptr, 0, CTL_SYN | CTL_ACK);
+  recover = rtxNxt = rackEndSeq = sndSmlEnd = initSndSeq;
+  sndEnd = initSndSeq + 1;
+  addSendSeg(0, CTL_SYN | CTL_ACK);
   state = St::SYN_RECEIVED;
 }
 
 void TCP::Connection::parseOptions(const uint8_t *begin, const uint8_t *end) {
+  uint32_t peerMss = DEFAULT_MSS;
+  bool peerWndScale = false, peerSack = false;
   for (auto *p = begin; p < end;) {
-    switch (*p++) {
-    case OPT_END: {
-      p = (uint8_t *)end;
+    uint8_t kind = *p++;
+    if (kind == OPT_END)
+      break;
+    if (kind == OPT_NOP)
+      continue;
+    if (p == end || *p < 2 || *p - 1 > end - p)
+      break; // Malformed
+    uint8_t len = *p;
+    const uint8_t *value = p + 1;
+    switch (kind) {
+    case OPT_MSS: {
+      if (len == 4)
+        peerMss = ntohs(*reinterpret_cast<const uint16_t *>(value));
       break;
     }
 
-    case OPT_NOP: {
+    case OPT_WSCALE: {
+      if (len == 3) {
+        peerWndScale = true;
+        sndWndShift = std::min(*value, MAX_WND_SHIFT);
+      }
       break;
     }
 
-    case OPT_MSS: {
-      uint8_t len = *p++;
-      if (len == 4)
-        mss = std::min(mss,
-                       (uint32_t)ntohs(*reinterpret_cast<const uint16_t *>(p)));
-      p += len - 2;
+    case OPT_SACK_PERMITTED: {
+      peerSack = len == 2;
       break;
     }
     }
+    p += len - 1;
+  }
+  mss = std::min(mss, peerMss);
+  // Scaling only if both sides offer it.
+  if (!peerWndScale) {
+    wndScale = false;
+    sndWndShift = rcvWndShift = 0;
+    updateRcvWnd();
   }
+  if (!peerSack)
+    sackOk = false;
 }
 
 void TCP::Connection::handleRecv(const void *data, size_t dataLen,
@@ -826,6 +1495,7 @@ void TCP::Connection::handleRecv(const void *data, size_t dataLen,
       if (h.ctrl & CTL_ACK) {
         advanceUnAck(ntohl(h.ackNum));
         sndWnd = ntohs(h.window);
+        maxSndWnd = sndWnd;
         sndWndUpdSeq = ntohl(h.seqNum);
         sndWndUpdAck = ntohl(h.ackNum);
         checkSend();
@@ -954,7 +1624,8 @@ void TCP::Connection::handleRecv(const void *data, size_t dataLen,
     switch (state) {
     case St::SYN_RECEIVED: {
       if (seqLe(sndUnAck, segAck) && seqLe(segAck, sndNxt)) {
-        sndWnd = ntohs(h.window);
+        sndWnd = ntohs(h.window) << sndWndShift;
+        maxSndWnd = std::max(maxSndWnd, sndWnd);
         sndWndUpdSeq = segSeq;
         sndWndUpdAck = segAck;
         checkSend();
@@ -979,25 +1650,36 @@ void TCP::Connection::handleRecv(const void *data, size_t dataLen,
     case St::FIN_WAIT_2:
     case St::CLOSE_WAIT:
     case St::CLOSING: {
+      if (sackOk)
+        handleSack(info.options, (const uint8_t *)data);
       if (seqLt(sndUnAck, segAck) && seqLe(segAck, sndNxt)) {
         advanceUnAck(segAck);
+      } else if (segAck == sndUnAck) {
+        // A duplicate ACK, for data received beyond a hole (RFC 5681).
+        if (dataLen == 0 && !(h.ctrl & (CTL_SYN | CTL_FIN)) &&
+            sndUnAck != sndNxt &&
+            (uint32_t)ntohs(h.window) << sndWndShift == sndWnd)
+          handleDupAck();
       } else if (seqLt(segAck, sndUnAck)) {
         // ignore
       } else if (seqLt(sndNxt, segAck)) {
         sendSeg(nullptr, 0, CTL_ACK);
         return;
       }
+      if (sackOk)
+        rackDetectLoss();
 
       if (seqLt(sndWndUpdSeq, segSeq) ||
           (sndWndUpdSeq == segSeq && seqLe(sndWndUpdAck, segAck))) {
-        sndWnd = ntohs(h.window);
+        sndWnd = ntohs(h.window) << sndWndShift;
+        maxSndWnd = std::max(maxSndWnd, sndWnd);
         sndWndUpdSeq = segSeq;
         sndWndUpdAck = segAck;
         checkSend();
       }
 
       if (state == St::FIN_WAIT_1) {
-        if (segAck == sndNxt)
+        if (segAck == sndNxt && !isFinQueued)
           state = St::FIN_WAIT_2;
       }
       if (state == St::FIN_WAIT_2) {
@@ -1010,7 +1692,7 @@ void TCP::Connection::handleRecv(const void *data, size_t dataLen,
       }
 
       if (state == St::CLOSING) {
-        if (segAck == sndNxt) {
+        if (segAck == sndNxt && !isFinQueued) {
           state = St::TIME_WAIT;
           removeSegments();
           timeWait =
@@ -1055,8 +1737,15 @@ void TCP::Connection::handleRecv(const void *data, size_t dataLen,
     case St::FIN_WAIT_1:
     case St::FIN_WAIT_2: {
       if (dataLen) {
+        // Out of order or filling a hole, to be acknowledged at once for
+        // the sender's loss detection.
+        bool inOrder =
+            segSeq == rcvNxt && rcvInfo.empty() && dataLen <= rcvWnd;
         deliverData(data, dataLen, segSeq);
-        sendAck = true;
+        if (inOrder)
+          delayAck(dataLen);
+        else
+          sendAck = true;
       }
       break;
     }
@@ -1084,7 +1773,7 @@ void TCP::Connection::handleRecv(const void *data, size_t dataLen,
         }
 
         case St::FIN_WAIT_1: {
-          if (sndUnAck == sndNxt) {
+          if (sndUnAck == sndNxt && !isFinQueued) {
             state = St::TIME_WAIT;
             removeSegments();
             timeWait = tcp.timer.add([this]() { tcp.removeConnection(this); },
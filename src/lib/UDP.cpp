@@ -15,7 +15,8 @@ constexpr int UDP::PROTOCOL_ID = 17;
 UDP::UDP(L3 &l3_) : l3(l3_) {}
 
 int UDP::sendSegment(const void *data, int dataLen, L3::Addr srcAddr,
-                     int srcPort, L3::Addr dstAddr, int dstPort) {
+                     int srcPort, L3::Addr dstAddr, int dstPort,
+                     L3::L2::Device *device) {
   int segLen = sizeof(Header) + dataLen;
 
   if (dataLen < 0 || (segLen >> 16) != 0) {
@@ -53,7 +54,7 @@ int UDP::sendSegment(const void *data, int dataLen, L3::Addr srcAddr,
 #endif
 
   return l3.send(seg, segLen, srcAddr, dstAddr, PROTOCOL_ID,
-                 {.autoRetry = true, .freeBuf = true});
+                 {.device = device, .autoRetry = true, .freeBuf = true});
 }
 
 void UDP::addOnRecv(RecvHandler handler, uint16_t port) {
@@ -2,9 +2,14 @@
 #include "NetStackFull.h"
 
 #include <climits>
+#include <cstdlib>
+#include <cstring>
 #include <shared_mutex>
 #include <mutex>
 
+#include <netinet/tcp.h>
+
+#include "CongestionControl.h"
 #include "log.h"
 
 class AutoNetStack : public NetStackFull {
@@ -65,6 +70,10 @@ AutoNetStack::AutoNetStack() : NetStackFull(), curFd(65536) {
                  .gateway = gw});
   }
 
+  // Warm start from (and save on exit to) a snapshot if configured.
+  if (const char *path = getenv("NETSTACK_SNAPSHOT"))
+    enableSnapshot(path);
+
   start();
 }
 
@@ -301,10 +310,49 @@ void __wrap_freeaddrinfo(struct addrinfo *ai) {
   }
 }
 
+// Congestion controls selectable by TCP_CONGESTION, by their names.
+static const struct {
+  const char *name;
+  TCP::CongestionControl *(*create)();
+} congestionControls[] = {
+    {"newreno", []() -> TCP::CongestionControl * { return new NewReno; }},
+    {"cubic", []() -> TCP::CongestionControl * { return new Cubic; }},
+    {"bbr", []() -> TCP::CongestionControl * { return new Bbr; }},
+};
+
 int __wrap_setsockopt(int fd, int level, int option_name,
                       const void *option_value, socklen_t option_len) {
-  if (!ns.getFd(fd))
+  auto *d = ns.getFd(fd);
+  if (!d)
     return __real_setsockopt(fd, level, option_name, option_value, option_len);
+
+  TCP::Connection *c = dynamic_cast<TCP::Connection *>(d);
+  if (c && level == IPPROTO_TCP && option_name == TCP_NODELAY) {
+    if (option_len < sizeof(int)) {
+      errno = EINVAL;
+      return -1;
+    }
+    bool noDelay = *(const int *)option_value;
+    ns.invoke([c, noDelay]() { c->noDelay = noDelay; });
+    return 0;
+  }
+  if (c && level == IPPROTO_TCP && option_name == TCP_CONGESTION) {
+    // The name may or may not be NUL-terminated within `option_len`.
+    const char *name = (const char *)option_value;
+    size_t nameLen = strnlen(name, option_len);
+    TCP::CongestionControl *cc = nullptr;
+    for (auto &&e : congestionControls)
+      if (strlen(e.name) == nameLen && memcmp(e.name, name, nameLen) == 0) {
+        cc = e.create();
+        break;
+      }
+    if (!cc) {
+      errno = ENOENT;
+      return -1;
+    }
+    ns.invoke([c, cc]() { c->setCongestionControl(cc); });
+    return 0;
+  }
   errno = ENOPROTOOPT;
   return -1;
 }
@@ -41,6 +41,8 @@ std::vector<Command *> allCommands = {
   new CmdIPAddrAdd(),
   new CmdArpInfo(),
   new CmdRouteAdd(),
+  new CmdRouteLoad(),
+  new CmdRouteSave(),
   new CmdRouteRip(),
   new CmdRouteInfo(),
   new CmdRouteRipInfo(),
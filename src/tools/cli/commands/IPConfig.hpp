@@ -62,10 +62,8 @@ public:
     if (auto *r = dynamic_cast<LpmRouting *>(routing)) {
       INVOKE({ rc = r->setEntry(entry); })
     } else if (auto *r = dynamic_cast<RIP *>(routing)) {
-      RIP::TabEntry rentry{.device = entry.device,
-                           .gateway = entry.gateway,
-                           .metric = 1,
-                           .expire = nullptr};
+      RIP::TabEntry rentry{
+          .device = entry.device, .gateway = entry.gateway, .metric = 1};
       if (argc >= 6 && sscanf(argv[5], "%d", &rentry.metric) != 1) {
         fprintf(stderr, "Invalid metric.\n");
         return 1;
@@ -80,6 +78,65 @@ public:
   }
 };
 
+class CmdRouteLoad : public Command {
+public:
+  CmdRouteLoad() : Command("route-load") {}
+
+  int main(int argc, char **argv) override {
+    bool isImage = argc == 3 && strcmp(argv[1], "-i") == 0;
+    if (argc != 2 && !isImage) {
+      fprintf(stderr, "usage: %s [-i] <file>\n", argv[0]);
+      return 1;
+    }
+    const char *path = argv[argc - 1];
+
+    int rc = 0;
+    auto begin = std::chrono::steady_clock::now();
+    INVOKE({
+      if (!ns.ip.getRouting())
+        ns.configStaticRouting();
+      auto *r = dynamic_cast<LpmRouting *>(ns.ip.getRouting());
+      if (!r)
+        rc = 1;
+      else if (isImage)
+        rc = r->loadImage(path, ns.ethernet);
+      else
+        rc = r->loadFile(path, ns.ethernet);
+    })
+    auto end = std::chrono::steady_clock::now();
+    if (rc != 0) {
+      fprintf(stderr, "Error loading routing table.\n");
+      return 1;
+    }
+    printf("Loaded in %.3f ms\n",
+           std::chrono::duration<double, std::milli>(end - begin).count());
+    return 0;
+  }
+};
+
+class CmdRouteSave : public Command {
+public:
+  CmdRouteSave() : Command("route-save") {}
+
+  int main(int argc, char **argv) override {
+    if (argc != 2) {
+      fprintf(stderr, "usage: %s <image>\n", argv[0]);
+      return 1;
+    }
+
+    int rc = 0;
+    INVOKE({
+      auto *r = dynamic_cast<LpmRouting *>(ns.ip.getRouting());
+      rc = r ? r->saveImage(argv[1]) : 1;
+    })
+    if (rc != 0) {
+      fprintf(stderr, "Error saving routing table.\n");
+      return 1;
+    }
+    return 0;
+  }
+};
+
 class CmdRouteRip : public Command {
 public:
   CmdRouteRip() : Command("route-rip") {}
@@ -138,10 +195,20 @@ public:
                  IP_ADDR_FMT_ARGS(e.first.addr), IP_ADDR_FMT_ARGS(e.first.mask),
                  e.second.device->name, IP_ADDR_FMT_ARGS(e.second.gateway),
                  e.second.metric,
-                 e.second.expire
-                     ? (e.second.expire->expireTime - Timer::Clock::now()) / 1s
+                 r->getExpireTime(e.second) != Timer::TimePoint::max()
+                     ? (r->getExpireTime(e.second) - Timer::Clock::now()) / 1s
                      : 0xffffffffL);
+          for (auto &&p : e.second.altPaths)
+            printf(IP_ADDR_FMT_STRING " | " IP_ADDR_FMT_STRING
+                                      " | %s | " IP_ADDR_FMT_STRING
+                                      " | %d | %+ld\n",
+                   IP_ADDR_FMT_ARGS(e.first.addr),
+                   IP_ADDR_FMT_ARGS(e.first.mask), p.device->name,
+                   IP_ADDR_FMT_ARGS(p.gateway), e.second.metric,
+                   (r->getExpireTime(p) - Timer::Clock::now()) / 1s);
         }
+        printf("Last convergence time: %.3fs\n",
+               std::chrono::duration<double>(r->getConvergenceTime()).count());
       } else {
         printf("No RIP routing\n");
       }
@@ -155,16 +222,19 @@ public:
   CmdArpInfo() : Command("arp-a") {}
 
   int main(int argc, char **argv) override {
+    static const char *STATES[] = {"INCOMPLETE", "REACHABLE", "STALE",
+                                   "PROBE"};
     INVOKE({
       const auto &table = ns.ip.arp.getTable();
-      printf("IP Address | MAC Address | Expire Time \n");
-      time_t curTime = time(nullptr);
+      printf("IP Address | MAC Address | State | Timer\n");
       for (auto &&e : table) {
-        printf(IP_ADDR_FMT_STRING " | " ETHERNET_ADDR_FMT_STRING " | %+ld\n",
+        printf(IP_ADDR_FMT_STRING " | " ETHERNET_ADDR_FMT_STRING
+                                  " | %s | %+ld\n",
                IP_ADDR_FMT_ARGS(e.first),
                ETHERNET_ADDR_FMT_ARGS(e.second.linkAddr),
-               e.second.expire
-                   ? (e.second.expire->expireTime - Timer::Clock::now()) / 1s
+               STATES[(int)e.second.state],
+               e.second.timer
+                   ? (e.second.timer->expireTime - Timer::Clock::now()) / 1s
                    : 0xffffffffL);
       }
     });